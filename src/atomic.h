@@ -7,5 +7,8 @@
 typedef _Atomic uint16_t atomic_uint16_t;
 typedef _Atomic uint32_t atomic_uint32_t;
 typedef _Atomic uint64_t atomic_uint64_t;
+typedef _Atomic int64_t atomic_int64_t;
+
+#define CACHE_LINE_SIZE 64
 
 #endif // ED2KD_ATOMIC_H
@@ -3,43 +3,50 @@
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
-#include <event2/listener.h>
 
 #include "ed2k_proto.h"
 #include "server.h"
 #include "packet.h"
 #include "log.h"
 #include "db.h"
+#include "search_cache.h"
+#include "source_cache.h"
 
-struct shared_file_entry {
-    /* key */
-    unsigned char hash[ED2K_HASH_SIZE];
-    /* makes this structure hashable */
-    UT_hash_handle hh;
-};
+/* lowids reserved by thread at once */
+#define LOWID_BLOCK     256
+/* lowids 1..LOWID_RANGE are given out, all below MAX_LOWID, multiple of LOWID_BLOCK */
+#define LOWID_RANGE     (MAX_LOWID - LOWID_BLOCK)
+
+static THREAD_LOCAL uint32_t s_lowid_next;
+static THREAD_LOCAL uint32_t s_lowid_left;
 
 static uint32_t get_next_lowid(void)
 {
-    uint32_t old_id, new_id;
-
-    do {
-        old_id = atomic_load(&g_srv.lowid_counter);
-        new_id = old_id + 1;
-        if (new_id > MAX_LOWID)
-            new_id = 1;
-    } while (!atomic_compare_exchange_strong(&g_srv.lowid_counter, &old_id, new_id));
+    if (!s_lowid_left) {
+        s_lowid_next = atomic_fetch_add(&g_srv.lowid_counter, LOWID_BLOCK) % LOWID_RANGE + 1;
+        s_lowid_left = LOWID_BLOCK;
+    }
 
-    return new_id;
+    s_lowid_left--;
+    return s_lowid_next++;
 }
 
-struct client *client_new(void)
+struct client *client_new(struct io_loop *loop)
 {
     struct client *clnt = (struct client *) calloc(1, sizeof(*clnt));
 
-    if (atomic_fetch_add(&g_srv.user_count, 1) + 1 >= g_srv.cfg->max_clients) {
-        evconnlistener_disable(g_srv.tcp_listener);
+    counter_add(&g_srv.user_count, 1);
+    if (counter_get(&g_srv.user_count) >= g_srv.cfg->max_clients) {
+        server_disable_listeners();
     }
 
+    clnt->loop = loop;
+    clnt->status_slot = -1;
+
+    TAILQ_INIT(&clnt->jqueue);
+    pthread_mutex_init(&clnt->job_mutex, NULL);
+    atomic_store(&clnt->worker, atomic_fetch_add(&g_srv.next_worker, 1) % g_srv.thread_count);
+
     token_bucket_init(&clnt->limit_offer, g_srv.cfg->max_offers_limit);
     token_bucket_init(&clnt->limit_search, g_srv.cfg->max_searches_limit);
 
@@ -56,16 +63,11 @@ void client_delete(struct client *clnt)
             bufferevent_disable(clnt->bev, EV_READ | EV_WRITE);
         if (clnt->bev_pc)
             bufferevent_disable(clnt->bev_pc, EV_READ | EV_WRITE);
-        if (clnt->evtimer_status_notify)
-            event_del(clnt->evtimer_status_notify);
         if (clnt->evtimer_portcheck)
             event_del(clnt->evtimer_portcheck);
 
         // delete all events
-        if (clnt->evtimer_status_notify) {
-            event_free(clnt->evtimer_status_notify);
-            clnt->evtimer_status_notify = NULL;
-        }
+        server_status_remove(clnt);
         if (clnt->evtimer_portcheck) {
             event_free(clnt->evtimer_portcheck);
             clnt->evtimer_portcheck = NULL;
@@ -75,6 +77,16 @@ void client_delete(struct client *clnt)
             clnt->bev_pc = NULL;
         }
         if (clnt->bev) {
+            struct evbuffer *output = bufferevent_get_output(clnt->bev);
+
+            // messages explaining disconnect are still sent if socket accepts them,
+            // output start is frozen by bufferevent outside of its own write callback
+            packet_cork_flush(clnt->bev);
+            bufferevent_lock(clnt->bev);
+            evbuffer_unfreeze(output, 1);
+            evbuffer_write(output, bufferevent_getfd(clnt->bev));
+            evbuffer_freeze(output, 1);
+            bufferevent_unlock(clnt->bev);
             bufferevent_free(clnt->bev);
             clnt->bev = NULL;
         }
@@ -83,22 +95,27 @@ void client_delete(struct client *clnt)
 
         if (clnt->file_count) {
             db_remove_source(clnt);
-            atomic_fetch_sub(&g_srv.file_count, clnt->file_count);
+            // results must not list sources of disconnected client even with ttl
+            search_cache_invalidate_force();
+            counter_add(&g_srv.file_count, -(int64_t) clnt->file_count);
             clnt->file_count = 0;
         }
 
         struct shared_file_entry *she, *she_tmp;
         HASH_ITER(hh, clnt->shared_files, she, she_tmp) {
+            source_cache_invalidate(she->hash);
             HASH_DEL(clnt->shared_files, she);
             free(she);
         }
 
-        if (atomic_fetch_sub(&g_srv.user_count, 1) - 1 < g_srv.cfg->max_clients) {
-            evconnlistener_enable(g_srv.tcp_listener);
+        counter_add(&g_srv.user_count, -1);
+        if (counter_get(&g_srv.user_count) < g_srv.cfg->max_clients) {
+            server_enable_listeners();
         }
     }
 
     if (0 == atomic_load(&clnt->ref_cnt)) {
+        pthread_mutex_destroy(&clnt->job_mutex);
         free(clnt);
     }
 }
@@ -106,8 +123,21 @@ void client_delete(struct client *clnt)
 void client_search_files(struct client *clnt, struct search_node *search_tree)
 {
     size_t count = MAX_SEARCH_FILES;
-    struct evbuffer *buf = evbuffer_new();
+    struct evbuffer *buf;
     struct packet_search_result data;
+    unsigned char key[MAX_SEARCH_KEY_LEN];
+    int compress = (clnt->tcp_flags & CLI_CAP_ZLIB) && g_srv.cfg->compress_threshold;
+    unsigned flags = ((clnt->tcp_flags & CLI_CAP_NEWTAGS) ? SFF_NEWTAGS : 0) |
+            ((clnt->tcp_flags & CLI_CAP_LARGEFILES) ? SFF_LARGEFILES : 0);
+    size_t key_len = search_cache_make_key(search_tree,
+            (compress ? SEARCH_PACKED : 0) | (flags & SFF_NEWTAGS ? SEARCH_NEWTAGS : 0) |
+            (flags & SFF_LARGEFILES ? SEARCH_LARGEFILES : 0), key);
+    uint32_t generation = search_cache_generation();
+
+    if (key_len && search_cache_get(key, key_len, packet_output(clnt->bev)))
+        return;
+
+    buf = evbuffer_new();
 
     data.hdr.proto = PROTO_EDONKEY;
     //data.length = 0;
@@ -115,24 +145,55 @@ void client_search_files(struct client *clnt, struct search_node *search_tree)
     //data.files_count = 0;
     evbuffer_add(buf, &data, sizeof(data));
 
-    if (db_search_files(search_tree, buf, &count)) {
+    if (db_search_files(search_tree, buf, &count, flags)) {
         struct packet_search_result *ph = (struct packet_search_result *) evbuffer_pullup(buf, sizeof(*ph));
         ph->hdr.length = evbuffer_get_length(buf) - sizeof(ph->hdr);
         ph->files_count = count;
 
-        bufferevent_write_buffer(clnt->bev, buf);
+        if (compress && (evbuffer_get_length(buf) >= g_srv.cfg->compress_threshold))
+            packet_deflate(buf);
+
+        if (key_len)
+            search_cache_put(key, key_len, generation, buf);
+
+        evbuffer_add_buffer(packet_output(clnt->bev), buf);
     }
 
     evbuffer_free(buf);
 }
 
+static int client_sources_cacheable(void)
+{
+    enum source_selection selection = g_srv.cfg->source_selection;
+
+    // rotated and random windows differ on every request
+    return (SRC_SELECT_FIRST == selection) || (SRC_SELECT_COMPLETE == selection);
+}
+
+int client_get_sources_cached(struct client *clnt, const unsigned char *hash)
+{
+    return client_sources_cacheable() && source_cache_get(hash, packet_output(clnt->bev));
+}
+
 void client_get_sources(struct client *clnt, const unsigned char *hash)
 {
     struct file_source sources[MAX_FOUND_SOURCES];
     uint8_t src_count = ARRAY_SIZE(sources);
+    enum source_selection selection = g_srv.cfg->source_selection;
+    int cacheable = client_sources_cacheable();
+    uint32_t generation = 0;
+
+    if (cacheable) {
+        generation = source_cache_generation(hash);
+        if (source_cache_get(hash, packet_output(clnt->bev)))
+            return;
+    }
 
-    if (db_get_sources(hash, sources, &src_count))
+    if (db_get_sources(hash, sources, &src_count, selection)) {
+        if (cacheable)
+            source_cache_put(hash, generation, sources, src_count);
         send_found_sources(clnt->bev, hash, sources, src_count);
+    }
 }
 
 void client_portcheck_start(struct client *clnt)
@@ -144,7 +205,7 @@ void client_portcheck_start(struct client *clnt)
     client_sa.sin_addr.s_addr = clnt->ip;
     client_sa.sin_port = htons(clnt->port);
 
-    clnt->bev_pc = bufferevent_socket_new(g_srv.evbase_tcp, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+    clnt->bev_pc = bufferevent_socket_new(clnt->loop->evbase, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
     bufferevent_setcb(clnt->bev_pc, portcheck_read_cb, NULL, portcheck_event_cb, clnt);
 
     if (bufferevent_socket_connect(clnt->bev_pc, (struct sockaddr *) &client_sa, sizeof(client_sa)) < 0) {
@@ -152,8 +213,8 @@ void client_portcheck_start(struct client *clnt)
         clnt->bev_pc = NULL;
         client_portcheck_finish(clnt, PORTCHECK_FAILED);
     } else {
-        clnt->evtimer_portcheck = evtimer_new(g_srv.evbase_tcp, portcheck_timeout_cb, clnt);
-        evtimer_add(clnt->evtimer_portcheck, g_srv.portcheck_timeout_tv);
+        clnt->evtimer_portcheck = evtimer_new(clnt->loop->evbase, portcheck_timeout_cb, clnt);
+        evtimer_add(clnt->evtimer_portcheck, clnt->loop->portcheck_timeout_tv);
     }
 }
 
@@ -189,15 +250,14 @@ void client_portcheck_finish(struct client *clnt, enum portcheck_result result)
     }
 
     send_id_change(clnt->bev, clnt->id);
-
-    clnt->evtimer_status_notify = evtimer_new(g_srv.evbase_tcp, server_status_notify_cb, clnt);
-    event_add(clnt->evtimer_status_notify, g_srv.status_notify_tv);
+    server_status_add(clnt);
 }
 
 void client_share_files(struct client *clnt, struct pub_file *files, size_t count)
 {
     size_t i, real_count = 0;
     struct pub_file *f = files;
+    int ok;
 
     if (clnt->file_count > g_srv.cfg->max_files_per_client) {
         static const char msg[] = "WARNING: You reached shared files limit";
@@ -205,7 +265,7 @@ void client_share_files(struct client *clnt, struct pub_file *files, size_t coun
         return;
     }
 
-    if (atomic_load(&g_srv.file_count) > g_srv.cfg->max_files) {
+    if (counter_get(&g_srv.file_count) > g_srv.cfg->max_files) {
         static const char msg[] = "WARNING: Server reached shared files limit";
         send_server_message(clnt->bev, msg, sizeof(msg) - 1);
         return;
@@ -227,9 +287,36 @@ void client_share_files(struct client *clnt, struct pub_file *files, size_t coun
         f++;
     }
 
-    if (db_share_files(files, count, clnt)) {
+    ok = db_share_files(files, count, clnt);
+
+    // concurrent readers could see rows of failed offer before they were rolled back,
+    // results built from them must not be served until ttl expires
+    if (ok)
+        search_cache_invalidate();
+    else
+        search_cache_invalidate_force();
+    for (i = 0, f = files; i < count; ++i, ++f) {
+        if (f->name_len)
+            source_cache_invalidate(f->hash);
+    }
+
+    if (ok) {
         ED2KD_LOGDBG("client %u: published %u files, %u duplicates", clnt->id, count, count - real_count);
         clnt->file_count += real_count;
-        atomic_fetch_add(&g_srv.file_count, real_count);
+        counter_add(&g_srv.file_count, real_count);
+    } else {
+        // failed offer is undone by database, let client offer these files again
+        for (i = 0, f = files; i < count; ++i, ++f) {
+            struct shared_file_entry *she = NULL;
+
+            if (!f->name_len)
+                continue;
+
+            HASH_FIND(hh, clnt->shared_files, f->hash, sizeof(f->hash), she);
+            if (she) {
+                HASH_DEL(clnt->shared_files, she);
+                free(she);
+            }
+        }
     }
 }
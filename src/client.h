@@ -6,15 +6,23 @@
 #include "uthash/uthash.h"
 #include "atomic.h"
 #include "util.h"
+#include "job.h"
 
 struct search_node;
-struct shared_file_entry;
+struct io_loop;
 struct pub_file;
 
 #define MAX_NICK_LEN        255
 #define MAX_FOUND_SOURCES   200 // todo: move to config
 #define MAX_FOUND_FILES     200 // todo: move to config
 
+struct shared_file_entry {
+    /* key */
+    unsigned char hash[16];
+    /* makes this structure hashable */
+    UT_hash_handle hh;
+};
+
 enum portcheck_result {
     PORTCHECK_FAILED,
     PORTCHECK_SUCCESS
@@ -44,17 +52,32 @@ struct client {
     /* set of already shared files hashes */
     struct shared_file_entry *shared_files;
 
+    /* i/o loop which owns client's events */
+    struct io_loop *loop;
     /* connection bufferevent */
     struct bufferevent *bev;
     /* portcheck bufferevent */
     struct bufferevent *bev_pc;
     /* portcheck timeout timer */
     struct event *evtimer_portcheck;
-    /* status notify timer */
-    struct event *evtimer_status_notify;
+    /* status wheel slot, -1 if not notified (guarded by loop status_mutex) */
+    int status_slot;
+    /* status wheel slot entry */
+    TAILQ_ENTRY(client) wqentry;
+
+    /* pending jobs (mailbox) */
+    struct job_queue jqueue;
+    /* mailbox mutex */
+    pthread_mutex_t job_mutex;
+    /* client is on run queue or being processed (guarded by job_mutex) */
+    int scheduled;
+    /* run queue entry */
+    TAILQ_ENTRY(client) rqentry;
+    /* preferred job worker index */
+    atomic_uint32_t worker;
+    /* bit mask of coalesced job types already in mailbox */
+    atomic_uint32_t pending_jobs;
 
-    /* lock flag */
-    atomic_uint32_t locked;
     /* references counter */
     atomic_uint32_t ref_cnt;
     /* marked for remove flag */
@@ -77,9 +100,10 @@ struct client {
 
 /**
 @brief allocates and initializes empty client structure
+@param loop i/o loop which accepted connection
 @return pointer to new client structure
 */
-struct client *client_new(void);
+struct client *client_new(struct io_loop *loop);
 
 void client_delete(struct client *clnt);
 
@@ -90,7 +114,7 @@ static __inline void client_addref(struct client *clnt)
 
 static __inline void client_decref(struct client *clnt)
 {
-    if (!atomic_fetch_sub(&clnt->ref_cnt, 1) - 1 && atomic_load(&clnt->deleted))
+    if (1 == atomic_fetch_sub(&clnt->ref_cnt, 1) && atomic_load(&clnt->deleted))
         client_delete(clnt);
 }
 
@@ -102,6 +126,12 @@ void client_search_files(struct client *clnt, struct search_node *search_tree);
 
 void client_get_sources(struct client *clnt, const unsigned char *hash);
 
+/**
+@brief answers sources request from found sources cache only, never queries database
+@return non-zero if request was answered
+*/
+int client_get_sources_cached(struct client *clnt, const unsigned char *hash);
+
 void client_share_files(struct client *clnt, struct pub_file *files, size_t count);
 
 #endif // ED2KD_CLIENT_H
@@ -7,6 +7,7 @@
 #include "ed2k_proto.h"
 #include "version.h"
 #include "util.h"
+#include "packet.h"
 
 #define CFG_DEFAULT_PATH "ed2kd.conf"
 
@@ -25,6 +26,36 @@
 #define CFG_MAX_FILES_PER_CLIENT        "max_files_per_client"
 #define CFG_MAX_OFFERS_LIMIT            "max_offers_limit"
 #define CFG_MAX_SEARCHES_LIMIT          "max_searches_limit"
+#define CFG_WORKER_THREADS              "worker_threads"
+#define CFG_IO_THREADS                  "io_threads"
+#define CFG_INLINE_OPCODES              "inline_opcodes"
+#define CFG_SEARCH_CACHE_SIZE           "search_cache_size"
+#define CFG_SEARCH_CACHE_TTL            "search_cache_ttl"
+#define CFG_COMPRESS_THRESHOLD          "compress_threshold"
+#define CFG_SOURCE_CACHE_SIZE           "source_cache_size"
+#define CFG_SOURCE_SELECTION            "source_selection"
+#define CFG_STATUS_NOTIFY_MAX_INTERVAL  "status_notify_max_interval"
+#define CFG_STATUS_CHANGE_THRESHOLD     "status_change_threshold"
+#define CFG_STATUS_NOTIFY_JITTER        "status_notify_jitter"
+
+/**
+@brief checks that opcode is cheap enough to be processed on i/o thread
+@return non-zero if opcode never touches database and never deletes client
+*/
+static int config_inline_allowed(int opcode)
+{
+    switch (opcode) {
+        case OP_REJECT:
+        case OP_GETSERVERLIST:
+        case OP_GETSOURCES:
+        case OP_CALLBACKREQUEST:
+        case OP_QUERY_MORE_RESULT:
+        case OP_GETSOURCES_OBFU:
+            return 1;
+        default:
+            return 0;
+    }
+}
 
 int server_load_config(const char *path)
 {
@@ -79,8 +110,8 @@ int server_load_config(const char *path)
 
         /* (optional) welcome message + predefined server version */
         if (config_setting_lookup_string(root, CFG_WELCOME_MESSAGE, &str_val)) {
-            server_cfg->welcome_msg_len = sizeof(srv_ver) + strlen(str_val) + 1;
             evutil_snprintf(server_cfg->welcome_msg, sizeof(server_cfg->welcome_msg), "%s\n%s", srv_ver, str_val);
+            server_cfg->welcome_msg_len = strlen(server_cfg->welcome_msg);
         } else {
             server_cfg->welcome_msg_len = sizeof(srv_ver) - sizeof(char);
             strcpy(server_cfg->welcome_msg, srv_ver);
@@ -98,16 +129,18 @@ int server_load_config(const char *path)
 
         /* server name (optional) */
         if (config_setting_lookup_string(root, CFG_SERVER_NAME, &str_val)) {
-            size_t len = strlen(str_val) - 1;
+            size_t len = strlen(str_val);
             server_cfg->server_name_len = MAX_SERVER_NAME_LEN > len ? len : MAX_SERVER_NAME_LEN;
-            strncpy(server_cfg->server_name, str_val, server_cfg->server_name_len + 1);
+            memcpy(server_cfg->server_name, str_val, server_cfg->server_name_len);
+            server_cfg->server_name[server_cfg->server_name_len] = 0;
         }
 
         /* server description (optional) */
         if (config_setting_lookup_string(root, CFG_SERVER_DESCR, &str_val)) {
-            size_t len = strlen(str_val) - 1;
+            size_t len = strlen(str_val);
             server_cfg->server_descr_len = MAX_SERVER_DESCR_LEN > len ? len : MAX_SERVER_DESCR_LEN;
-            strncpy(server_cfg->server_descr, str_val, server_cfg->server_descr_len + 1);
+            memcpy(server_cfg->server_descr, str_val, server_cfg->server_descr_len);
+            server_cfg->server_descr[server_cfg->server_descr_len] = 0;
         }
 
         /* allow lowid */
@@ -142,6 +175,24 @@ int server_load_config(const char *path)
             ret = 0;
         }
 
+        /* change-driven status notifications (optional) */
+        server_cfg->status_notify_max_interval = 0;
+        if (config_setting_lookup_int(root, CFG_STATUS_NOTIFY_MAX_INTERVAL, &int_val)) {
+            unsigned min_interval = server_cfg->status_notify_tv.tv_sec * 1000 + server_cfg->status_notify_tv.tv_usec / 1000;
+            if (int_val > 0)
+                server_cfg->status_notify_max_interval = (unsigned) int_val > min_interval ? (unsigned) int_val : min_interval;
+        }
+
+        server_cfg->status_change_threshold = 5;
+        if (config_setting_lookup_int(root, CFG_STATUS_CHANGE_THRESHOLD, &int_val)) {
+            server_cfg->status_change_threshold = int_val > 0 ? int_val : 0;
+        }
+
+        server_cfg->status_notify_jitter = 0;
+        if (config_setting_lookup_int(root, CFG_STATUS_NOTIFY_JITTER, &int_val)) {
+            server_cfg->status_notify_jitter = int_val > 0 ? (int_val < 100 ? int_val : 100) : 0;
+        }
+
         /* max clients */
         if (config_setting_lookup_int(root, CFG_MAX_CLIENTS, &int_val)) {
             server_cfg->max_clients = int_val;
@@ -191,6 +242,79 @@ int server_load_config(const char *path)
                     " missing");
             ret = 0;
         }
+
+        /* search result cache (optional) */
+        server_cfg->search_cache_size = 1024;
+        if (config_setting_lookup_int(root, CFG_SEARCH_CACHE_SIZE, &int_val)) {
+            server_cfg->search_cache_size = int_val > 0 ? int_val : 0;
+        }
+        server_cfg->search_cache_ttl = 30;
+        if (config_setting_lookup_int(root, CFG_SEARCH_CACHE_TTL, &int_val)) {
+            server_cfg->search_cache_ttl = int_val > 0 ? int_val : 0;
+        }
+
+        /* outgoing packets compression (optional) */
+        server_cfg->compress_threshold = 512;
+        if (config_setting_lookup_int(root, CFG_COMPRESS_THRESHOLD, &int_val)) {
+            server_cfg->compress_threshold = int_val > 0 ? int_val : 0;
+        }
+
+        /* found sources cache (optional) */
+        server_cfg->source_cache_size = 4096;
+        if (config_setting_lookup_int(root, CFG_SOURCE_CACHE_SIZE, &int_val)) {
+            server_cfg->source_cache_size = int_val > 0 ? int_val : 0;
+        }
+
+        /* found sources order (optional) */
+        server_cfg->source_selection = SRC_SELECT_FIRST;
+        if (config_setting_lookup_string(root, CFG_SOURCE_SELECTION, &str_val)) {
+            if (strcmp(str_val, "first") == 0) {
+                server_cfg->source_selection = SRC_SELECT_FIRST;
+            } else if (strcmp(str_val, "rotate") == 0) {
+                server_cfg->source_selection = SRC_SELECT_ROTATE;
+            } else if (strcmp(str_val, "random") == 0) {
+                server_cfg->source_selection = SRC_SELECT_RANDOM;
+            } else if (strcmp(str_val, "complete") == 0) {
+                server_cfg->source_selection = SRC_SELECT_COMPLETE;
+            } else {
+                ED2KD_LOGERR("config: "
+                        CFG_SOURCE_SELECTION
+                        " must be one of first, rotate, random, complete");
+                ret = 0;
+            }
+        }
+
+        /* worker threads (optional) */
+        if (config_setting_lookup_int(root, CFG_WORKER_THREADS, &int_val)) {
+            server_cfg->worker_threads = int_val > 0 ? int_val : 0;
+        }
+
+        /* i/o threads (optional) */
+        server_cfg->io_threads = 1;
+        if (config_setting_lookup_int(root, CFG_IO_THREADS, &int_val)) {
+            server_cfg->io_threads = int_val > 1 ? int_val : 1;
+        }
+
+        /* opcodes processed on i/o thread (optional) */
+        {
+            config_setting_t *opcodes = config_setting_get_member(root, CFG_INLINE_OPCODES);
+            if (opcodes) {
+                int i, count = config_setting_length(opcodes);
+                for (i = 0; i < count; ++i) {
+                    int opcode = config_setting_get_int_elem(opcodes, i);
+                    if (!config_inline_allowed(opcode)) {
+                        ED2KD_LOGERR("config: "
+                                CFG_INLINE_OPCODES
+                                " has opcode 0x%02x which may block i/o thread"
+                                " (allowed: 0x05, 0x14, 0x19, 0x1c, 0x21, 0x23)", opcode);
+                        ret = 0;
+                        break;
+                    }
+                    server_cfg->opcode_route[opcode] = ROUTE_INLINE;
+                    server_cfg->inline_packets = 1;
+                }
+            }
+        }
     } else {
         ED2KD_LOGWRN("config: failed to parse %s(error:%s at %d line)", path,
                 config_error_text(&config), config_error_line(&config));
@@ -202,9 +326,18 @@ int server_load_config(const char *path)
     if (!ret) {
         free(server_cfg);
     } else {
-        server_cfg->srv_tcp_flags = SRV_TCPFLG_COMPRESSION | SRV_TCPFLG_TYPETAGINTEGER | SRV_TCPFLG_LARGEFILES;
+        server_cfg->srv_tcp_flags = SRV_TCPFLG_COMPRESSION | SRV_TCPFLG_NEWTAGS | SRV_TCPFLG_UNICODE |
+                SRV_TCPFLG_TYPETAGINTEGER | SRV_TCPFLG_LARGEFILES;
         evutil_inet_pton(AF_INET, server_cfg->listen_addr, &server_cfg->listen_addr_inaddr);
-        g_srv.cfg = server_cfg;
+
+        if (packet_build_static(server_cfg)) {
+            g_srv.cfg = server_cfg;
+        } else {
+            ED2KD_LOGERR("config: failed to build static packets");
+            free(server_cfg->listen_addr);
+            free(server_cfg);
+            ret = 0;
+        }
     }
 
     return ret;
@@ -216,4 +349,5 @@ void server_free_config(void)
     g_srv.cfg = NULL;
     free(cfg->listen_addr);
     free(cfg);
+    packet_free_static();
 }
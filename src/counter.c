@@ -0,0 +1,28 @@
+#include "counter.h"
+#include "util.h"
+
+static atomic_uint32_t s_next_shard;
+static THREAD_LOCAL size_t s_shard_idx;
+static THREAD_LOCAL int s_shard_ready;
+
+size_t counter_shard_idx(void)
+{
+    if (!s_shard_ready) {
+        s_shard_idx = atomic_fetch_add(&s_next_shard, 1) % COUNTER_SHARDS;
+        s_shard_ready = 1;
+    }
+
+    return s_shard_idx;
+}
+
+uint64_t counter_get(struct sharded_counter *counter)
+{
+    int64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < COUNTER_SHARDS; ++i) {
+        sum += atomic_load_explicit(&counter->shards[i].val, memory_order_relaxed);
+    }
+
+    return sum > 0 ? (uint64_t) sum : 0;
+}
@@ -0,0 +1,46 @@
+#ifndef ED2KD_COUNTER_H
+#define ED2KD_COUNTER_H
+
+/*
+@file counter.h Counters sharded by thread
+
+Every thread adds to its own cache line, so writers never bounce shared
+line. Value is aggregated only when read. Shards may go negative when
+value is decremented by other thread than it was incremented by, only
+sum of all shards is meaningful.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include "atomic.h"
+
+#define COUNTER_SHARDS  32
+
+struct counter_shard {
+    atomic_int64_t val;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct sharded_counter {
+    struct counter_shard shards[COUNTER_SHARDS];
+};
+
+/**
+@brief shard index of calling thread, assigned on first call
+*/
+size_t counter_shard_idx(void);
+
+/**
+@brief adds delta to calling thread shard
+*/
+static inline void counter_add(struct sharded_counter *counter, int64_t delta)
+{
+    atomic_fetch_add_explicit(&counter->shards[counter_shard_idx()].val, delta, memory_order_relaxed);
+}
+
+/**
+@brief sums all shards
+@return current value, concurrent updates may be partially seen
+*/
+uint64_t counter_get(struct sharded_counter *counter);
+
+#endif // ED2KD_COUNTER_H
@@ -100,13 +100,40 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
 int db_remove_source(const struct client *owner);
 
 /**
+@param flags  write_search_file() flags
 @return non-zero on success
 */
-int db_search_files(struct search_node *root, struct evbuffer *buf, size_t *count);
+int db_search_files(struct search_node *root, struct evbuffer *buf, size_t *count, unsigned flags);
+
+/* order of sources returned by db_get_sources() */
+enum source_selection {
+    /* first found, same for every request */
+    SRC_SELECT_FIRST,
+    /* window moving by found count on every request */
+    SRC_SELECT_ROTATE,
+    /* window starting from random source */
+    SRC_SELECT_RANDOM,
+    /* complete sources first, then highid ones */
+    SRC_SELECT_COMPLETE
+};
 
 /**
 @return non-zero on success
 */
-int db_get_sources(const unsigned char *hash, struct file_source *out_sources, uint8_t *size);
+int db_get_sources(const unsigned char *hash, struct file_source *out_sources, uint8_t *size,
+        enum source_selection selection);
+
+struct db_stats {
+    /* searches served by cached prepared statement */
+    uint64_t search_stmt_hits;
+    /* searches which required statement preparation */
+    uint64_t search_stmt_misses;
+};
+
+/**
+@brief collects database backend statistics
+@param stats
+*/
+void db_get_stats(struct db_stats *stats);
 
 #endif // ED2KD_DB_H
@@ -0,0 +1,694 @@
+#include "db.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <event2/util.h>
+
+#include "uthash/uthash.h"
+#include "ed2k_proto.h"
+#include "packet.h"
+#include "log.h"
+#include "client.h"
+#include "atomic.h"
+#include "word_index.h"
+
+/*
+  Native in-memory storage. Files are kept in hash table keyed by ed2k hash
+  and split into shards by first hash byte (ed2k hash is md4, so it is
+  distributed uniformly), every shard is guarded by its own rwlock.
+  Sources are stored right in the file entry, so sources lookup is a single
+  hash probe under shard read lock.
+  Every file also gets numeric id (slot in shard's files array and shard
+  index) which is used by file names index.
+*/
+
+#define FILE_SHARD_COUNT        256
+#define INLINE_SOURCES          2
+#define MAX_SEARCH_DEPTH        32
+
+#define DB_CHECK(x)         if (!(x)) goto failed;
+#define MAKE_SID(x)         ( ((uint64_t)(x)->id<<32) | (uint64_t)(x)->port )
+#define GET_SID_ID(sid)     (uint32_t)((sid)>>32)
+#define GET_SID_PORT(sid)   (uint16_t)(sid)
+#define GET_SHARD(hash)     (&s_shards[(hash)[0] % FILE_SHARD_COUNT])
+#define MAKE_FID(shard, slot) (((uint32_t)(slot) << 8) | (uint32_t)((shard) - s_shards))
+#define GET_FID_SHARD(fid)  (&s_shards[(fid) & 0xff])
+#define GET_FID_SLOT(fid)   ((fid) >> 8)
+
+struct mem_source {
+    /* client id and port */
+    uint64_t sid;
+    /* rating given by source */
+    uint32_t rating;
+    /* source has complete file */
+    uint8_t complete;
+};
+
+struct mem_file {
+    /* key */
+    unsigned char hash[ED2K_HASH_SIZE];
+    /* numeric id */
+    uint32_t fid;
+    /* name followed by media codec */
+    char *strings;
+    /* name length */
+    uint16_t name_len;
+    /* extension length, extension points to the end of name */
+    uint16_t ext_len;
+    /* media codec length */
+    uint16_t media_codec_len;
+    /* size */
+    uint64_t size;
+    /* ed2k file type */
+    uint32_t type;
+    /* media length */
+    uint32_t media_length;
+    /* media bitrate */
+    uint32_t media_bitrate;
+    /* sum of sources ratings */
+    uint32_t rating;
+    /* number of sources which rated file */
+    uint32_t rated_count;
+    /* sources count */
+    atomic_uint32_t srcavail;
+    /* complete sources count */
+    atomic_uint32_t srccomplete;
+    /* rotating sources cursor */
+    atomic_uint32_t src_cursor;
+    /* sources array capacity */
+    uint32_t src_capacity;
+    /* sources array, points to inline_sources or to heap */
+    struct mem_source *sources;
+    /* few first sources are stored without extra allocation */
+    struct mem_source inline_sources[INLINE_SOURCES];
+    /* makes this structure hashable */
+    UT_hash_handle hh;
+};
+
+struct file_shard {
+    /* guards files table and its entries */
+    pthread_rwlock_t lock;
+    /* files table */
+    struct mem_file *files;
+    /* files by slot */
+    struct mem_file **slots;
+    /* used slots count */
+    uint32_t slot_count;
+    /* slots array capacity */
+    uint32_t slot_capacity;
+    /* released slots */
+    uint32_t *free_slots;
+    /* released slots count */
+    uint32_t free_count;
+} __attribute__((aligned(64)));
+
+static struct file_shard s_shards[FILE_SHARD_COUNT];
+
+#define FILE_NAME(f)        ((f)->strings)
+#define FILE_EXT(f)         ((f)->strings + (f)->name_len - (f)->ext_len)
+#define FILE_CODEC(f)       ((f)->strings + (f)->name_len)
+
+static void file_free(struct mem_file *f)
+{
+    if (f->sources != f->inline_sources)
+        free(f->sources);
+    free(f->strings);
+    free(f);
+}
+
+static struct mem_file *file_new(struct file_shard *shard, const unsigned char *hash)
+{
+    struct mem_file *f;
+    uint32_t slot;
+
+    if (!shard->free_count && (shard->slot_count == shard->slot_capacity)) {
+        uint32_t capacity = shard->slot_capacity ? shard->slot_capacity * 2 : 1024;
+        struct mem_file **slots = (struct mem_file **) realloc(shard->slots, capacity * sizeof(*slots));
+        uint32_t *free_slots;
+
+        if (!slots)
+            return NULL;
+        shard->slots = slots;
+
+        free_slots = (uint32_t *) realloc(shard->free_slots, capacity * sizeof(*free_slots));
+        if (!free_slots)
+            return NULL;
+        shard->free_slots = free_slots;
+
+        shard->slot_capacity = capacity;
+    }
+
+    f = (struct mem_file *) calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+
+    if (shard->free_count)
+        slot = shard->free_slots[--shard->free_count];
+    else
+        slot = shard->slot_count++;
+
+    shard->slots[slot] = f;
+
+    memcpy(f->hash, hash, sizeof(f->hash));
+    f->fid = MAKE_FID(shard, slot);
+    f->sources = f->inline_sources;
+    f->src_capacity = INLINE_SOURCES;
+    HASH_ADD(hh, shard->files, hash, sizeof(f->hash), f);
+
+    return f;
+}
+
+static void file_delete(struct file_shard *shard, struct mem_file *f)
+{
+    uint32_t slot = GET_FID_SLOT(f->fid);
+
+    if (f->name_len)
+        word_index_remove(FILE_NAME(f), f->name_len, f->fid);
+
+    shard->slots[slot] = NULL;
+    shard->free_slots[shard->free_count++] = slot;
+
+    HASH_DEL(shard->files, f);
+    file_free(f);
+}
+
+static int file_set_meta(struct mem_file *f, const struct pub_file *pf)
+{
+    const char *ext;
+    char *strings;
+
+    f->size = pf->size;
+    f->type = pf->type;
+    f->media_length = pf->media_length;
+    f->media_bitrate = pf->media_bitrate;
+
+    if ((f->name_len == pf->name_len) && (f->media_codec_len == pf->media_codec_len) &&
+        (0 == memcmp(FILE_NAME(f), pf->name, pf->name_len)) &&
+        (0 == memcmp(FILE_CODEC(f), pf->media_codec, pf->media_codec_len)))
+        return 1;
+
+    strings = (char *) malloc(pf->name_len + pf->media_codec_len);
+    if (!strings)
+        return 0;
+
+    memcpy(strings, pf->name, pf->name_len);
+    memcpy(strings + pf->name_len, pf->media_codec, pf->media_codec_len);
+
+    if (f->name_len)
+        word_index_remove(FILE_NAME(f), f->name_len, f->fid);
+
+    free(f->strings);
+    f->strings = strings;
+    f->name_len = pf->name_len;
+    f->media_codec_len = pf->media_codec_len;
+
+    ext = file_extension(pf->name, pf->name_len);
+    f->ext_len = ext ? pf->name + pf->name_len - ext : 0;
+    if (f->ext_len > MAX_FILEEXT_LEN)
+        f->ext_len = 0;
+
+    return word_index_add(FILE_NAME(f), f->name_len, f->fid);
+}
+
+static int file_add_source(struct mem_file *f, uint64_t sid, const struct pub_file *pf)
+{
+    uint32_t count = atomic_load_explicit(&f->srcavail, memory_order_relaxed);
+    struct mem_source *src;
+
+    if (count == f->src_capacity) {
+        uint32_t capacity = f->src_capacity * 2;
+        struct mem_source *sources = (struct mem_source *) malloc(capacity * sizeof(*sources));
+
+        if (!sources)
+            return 0;
+
+        memcpy(sources, f->sources, count * sizeof(*sources));
+        if (f->sources != f->inline_sources)
+            free(f->sources);
+        f->sources = sources;
+        f->src_capacity = capacity;
+    }
+
+    src = &f->sources[count];
+    src->sid = sid;
+    src->rating = pf->rating;
+    src->complete = pf->complete;
+
+    if (src->rating) {
+        f->rating += src->rating;
+        f->rated_count++;
+    }
+    atomic_fetch_add_explicit(&f->srccomplete, src->complete, memory_order_relaxed);
+    atomic_store_explicit(&f->srcavail, count + 1, memory_order_release);
+
+    return 1;
+}
+
+/**
+@return number of sources left
+*/
+static uint32_t file_remove_source(struct mem_file *f, uint64_t sid)
+{
+    uint32_t count = atomic_load_explicit(&f->srcavail, memory_order_relaxed);
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        struct mem_source *src = &f->sources[i];
+
+        if (src->sid != sid)
+            continue;
+
+        if (src->rating) {
+            f->rating -= src->rating;
+            f->rated_count--;
+        }
+        atomic_fetch_sub_explicit(&f->srccomplete, src->complete, memory_order_relaxed);
+
+        // order of sources doesn't matter
+        *src = f->sources[--count];
+        atomic_store_explicit(&f->srcavail, count, memory_order_release);
+        break;
+    }
+
+    return count;
+}
+
+int db_create(void)
+{
+    size_t i;
+
+    if (!word_index_init())
+        return 0;
+
+    for (i = 0; i < FILE_SHARD_COUNT; ++i) {
+        if (pthread_rwlock_init(&s_shards[i].lock, NULL)) {
+            ED2KD_LOGERR("failed to init shard lock");
+            return 0;
+        }
+        s_shards[i].files = NULL;
+    }
+
+    return 1;
+}
+
+int db_destroy(void)
+{
+    size_t i;
+
+    for (i = 0; i < FILE_SHARD_COUNT; ++i) {
+        struct file_shard *shard = &s_shards[i];
+        struct mem_file *f, *tmp;
+
+        HASH_ITER(hh, shard->files, f, tmp) {
+            HASH_DEL(shard->files, f);
+            file_free(f);
+        }
+        free(shard->slots);
+        free(shard->free_slots);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+
+    word_index_destroy();
+
+    return 1;
+}
+
+int db_open(void)
+{
+    return 1;
+}
+
+int db_close(void)
+{
+    return 1;
+}
+
+/**
+@brief removes source from file, file without sources is deleted
+*/
+static void remove_file_source(const unsigned char *hash, uint64_t sid)
+{
+    struct file_shard *shard = GET_SHARD(hash);
+    struct mem_file *f;
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    HASH_FIND(hh, shard->files, hash, ED2K_HASH_SIZE, f);
+    if (f && !file_remove_source(f, sid))
+        file_delete(shard, f);
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+int db_share_files(const struct pub_file *files, size_t count, const struct client *owner)
+{
+    uint64_t sid = MAKE_SID(owner);
+    const struct pub_file *first = files;
+
+    for (; count > 0; --count, ++files) {
+        struct file_shard *shard;
+        struct mem_file *f;
+        int ok;
+
+        if (!files->name_len)
+            continue;
+
+        shard = GET_SHARD(files->hash);
+        pthread_rwlock_wrlock(&shard->lock);
+
+        HASH_FIND(hh, shard->files, files->hash, sizeof(files->hash), f);
+        if (!f)
+            f = file_new(shard, files->hash);
+
+        ok = f && file_set_meta(f, files) && file_add_source(f, sid, files);
+
+        if (f && !atomic_load_explicit(&f->srcavail, memory_order_relaxed))
+            file_delete(shard, f);
+
+        pthread_rwlock_unlock(&shard->lock);
+
+        DB_CHECK(ok);
+    }
+
+    return 1;
+
+    failed:
+    ED2KD_LOGERR("failed to add file to db (out of memory)");
+
+    // offer fails as a whole, like sqlite transaction
+    for (; first != files; ++first) {
+        if (first->name_len)
+            remove_file_source(first->hash, sid);
+    }
+
+    return 0;
+}
+
+int db_remove_source(const struct client *owner)
+{
+    uint64_t sid = MAKE_SID(owner);
+    struct shared_file_entry *she, *she_tmp;
+
+    HASH_ITER(hh, owner->shared_files, she, she_tmp) {
+        remove_file_source(she->hash, sid);
+    }
+
+    return 1;
+}
+
+static int file_has_word(const struct mem_file *f, const char *word, size_t word_len)
+{
+    const char *name_word;
+    size_t pos = 0, len;
+
+    while ((name_word = next_word(FILE_NAME(f), f->name_len, &pos, &len))) {
+        if ((len == word_len) && (0 == evutil_ascii_strncasecmp(name_word, word, len)))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int file_match_term(const struct mem_file *f, const char *term, size_t term_len)
+{
+    const char *word;
+    size_t pos = 0, len;
+    int words = 0;
+
+    while ((word = next_word(term, term_len, &pos, &len))) {
+        if (!file_has_word(f, word, len))
+            return 0;
+        words++;
+    }
+
+    return words;
+}
+
+/*
+  Same semantics as in sqlite backend: logical operators apply to name
+  terms only, all other constraints must be satisfied together.
+*/
+static int file_match(const struct mem_file *f, const struct search_node *node)
+{
+    switch (node->type) {
+        case ST_AND:
+            return file_match(f, node->left) && file_match(f, node->right);
+        case ST_OR:
+            if (node->string_term)
+                return file_match(f, node->left) || file_match(f, node->right);
+            return file_match(f, node->left) && file_match(f, node->right);
+        case ST_NOT:
+            if (node->string_term)
+                return file_match(f, node->left) && !file_match(f, node->right);
+            return file_match(f, node->left) && file_match(f, node->right);
+        case ST_STRING:
+            return file_match_term(f, node->str_val, node->str_len);
+        case ST_EXTENSION:
+            return (node->str_len == f->ext_len) &&
+                   (0 == evutil_ascii_strncasecmp(FILE_EXT(f), node->str_val, node->str_len));
+        case ST_CODEC:
+            return (node->str_len == f->media_codec_len) &&
+                   (0 == evutil_ascii_strncasecmp(FILE_CODEC(f), node->str_val, node->str_len));
+        case ST_TYPE:
+            return f->type == get_ed2k_file_type(node->str_val, node->str_len);
+        case ST_MINSIZE:
+            return f->size > node->int_val;
+        case ST_MAXSIZE:
+            return f->size < node->int_val;
+        case ST_SRCAVAIL:
+            return atomic_load_explicit(&f->srcavail, memory_order_relaxed) > node->int_val;
+        case ST_SRCCOMLETE:
+            return atomic_load_explicit(&f->srccomplete, memory_order_relaxed) > node->int_val;
+        case ST_MINBITRATE:
+            return f->media_bitrate > node->int_val;
+        case ST_MINLENGTH:
+            return f->media_length > node->int_val;
+        default:
+            return 0;
+    }
+}
+
+/**
+@return non-zero if search tree is complete and not too deep
+*/
+static int check_search_tree(const struct search_node *node, unsigned depth)
+{
+    if (depth > MAX_SEARCH_DEPTH)
+        return 0;
+
+    if ((ST_AND <= node->type) && (ST_NOT >= node->type))
+        return check_search_tree(node->left, depth + 1) && check_search_tree(node->right, depth + 1);
+
+    return ST_EMPTY != node->type;
+}
+
+static int write_file(struct evbuffer *buf, const struct mem_file *f, unsigned flags)
+{
+    struct search_file sfile;
+    uint64_t sid = f->sources[0].sid;
+
+    memset(&sfile, 0, sizeof sfile);
+
+    sfile.hash = f->hash;
+    sfile.name_len = f->name_len;
+    sfile.name = FILE_NAME(f);
+    sfile.size = f->size;
+    sfile.type = f->type;
+    sfile.ext_len = f->ext_len;
+    sfile.ext = FILE_EXT(f);
+    sfile.srcavail = atomic_load_explicit(&f->srcavail, memory_order_relaxed);
+    sfile.srccomplete = atomic_load_explicit(&f->srccomplete, memory_order_relaxed);
+    sfile.rating = f->rating;
+    sfile.rated_count = f->rated_count;
+    sfile.client_id = GET_SID_ID(sid);
+    sfile.client_port = GET_SID_PORT(sid);
+    sfile.media_length = f->media_length;
+    sfile.media_bitrate = f->media_bitrate;
+    sfile.media_codec_len = f->media_codec_len > MAX_FILEEXT_LEN ? MAX_FILEEXT_LEN : f->media_codec_len;
+    sfile.media_codec = FILE_CODEC(f);
+
+    return write_search_file(buf, &sfile, flags);
+}
+
+/**
+@brief finds candidate files for name terms of search tree
+@param out  candidates list
+@param all  set to non-zero when subtree doesn't restrict file name
+@return non-zero on success
+*/
+static int search_index(const struct search_node *node, struct fid_list *out, int *all)
+{
+    struct fid_list right;
+    int right_all, ok = 1;
+
+    switch (node->type) {
+        case ST_AND:
+        case ST_OR:
+        case ST_NOT:
+            if (!search_index(node->left, out, all))
+                return 0;
+            if (!search_index(node->right, &right, &right_all)) {
+                fid_list_free(out);
+                return 0;
+            }
+
+            if (node->string_term && (ST_OR == node->type)) {
+                ok = fid_list_or(out, &right);
+            } else if (node->string_term && (ST_NOT == node->type)) {
+                ok = fid_list_not(out, &right);
+            } else if (*all) {
+                // constraints don't restrict candidates
+                fid_list_free(out);
+                *out = right;
+                *all = right_all;
+                return 1;
+            } else if (!right_all) {
+                ok = fid_list_and(out, &right);
+            }
+
+            fid_list_free(&right);
+            if (!ok)
+                fid_list_free(out);
+            return ok;
+
+        case ST_STRING:
+            *all = 0;
+            return word_index_find(node->str_val, node->str_len, out);
+
+        default:
+            *all = 1;
+            out->ids = NULL;
+            out->count = 0;
+            return 1;
+    }
+}
+
+int db_search_files(struct search_node *root, struct evbuffer *buf, size_t *count, unsigned flags)
+{
+    struct fid_list fids;
+    size_t i, found = 0;
+    int all, ok = 1;
+
+    DB_CHECK(check_search_tree(root, 0));
+    DB_CHECK(search_index(root, &fids, &all));
+
+    if (all) {
+        // no name terms, full scan
+        for (i = 0; ok && (i < FILE_SHARD_COUNT) && (found < *count); ++i) {
+            struct file_shard *shard = &s_shards[i];
+            struct mem_file *f, *tmp;
+
+            pthread_rwlock_rdlock(&shard->lock);
+            HASH_ITER(hh, shard->files, f, tmp) {
+                if (found == *count)
+                    break;
+                if (file_match(f, root)) {
+                    ok = write_file(buf, f, flags);
+                    if (!ok)
+                        break;
+                    found++;
+                }
+            }
+            pthread_rwlock_unlock(&shard->lock);
+        }
+    } else {
+        for (i = 0; ok && (i < fids.count) && (found < *count); ++i) {
+            uint32_t fid = fids.ids[i];
+            struct file_shard *shard = GET_FID_SHARD(fid);
+            struct mem_file *f = NULL;
+
+            pthread_rwlock_rdlock(&shard->lock);
+
+            if (GET_FID_SLOT(fid) < shard->slot_count)
+                f = shard->slots[GET_FID_SLOT(fid)];
+
+            // file could be replaced after index lookup, check it again
+            if (f && file_match(f, root)) {
+                ok = write_file(buf, f, flags);
+                found += ok;
+            }
+
+            pthread_rwlock_unlock(&shard->lock);
+        }
+
+        fid_list_free(&fids);
+    }
+
+    // files_count must match entries in packet, result is dropped as a whole
+    if (!ok) {
+        ED2KD_LOGERR("failed perform search query (out of memory)");
+        return 0;
+    }
+
+    *count = found;
+    return 1;
+
+    failed:
+    ED2KD_LOGERR("failed perform search query (malformed search tree)");
+    return 0;
+}
+
+/**
+@brief source priority for SRC_SELECT_COMPLETE, lower is better
+*/
+static int source_priority(const struct mem_source *src)
+{
+    int lowid = GET_SID_ID(src->sid) < MAX_LOWID;
+    return (src->complete ? 0 : 2) + lowid;
+}
+
+int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8_t *count,
+        enum source_selection selection)
+{
+    struct file_shard *shard = GET_SHARD(hash);
+    struct mem_file *f;
+    uint8_t i = 0;
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    HASH_FIND(hh, shard->files, hash, ED2K_HASH_SIZE, f);
+    if (f) {
+        uint32_t srcavail = atomic_load_explicit(&f->srcavail, memory_order_relaxed);
+        uint32_t start = 0, j;
+
+        if (SRC_SELECT_COMPLETE == selection) {
+            int prio;
+
+            for (prio = 0; (prio < 4) && (i < *count); ++prio) {
+                for (j = 0; (j < srcavail) && (i < *count); ++j) {
+                    if (source_priority(&f->sources[j]) == prio) {
+                        sources[i].ip = GET_SID_ID(f->sources[j].sid);
+                        sources[i].port = GET_SID_PORT(f->sources[j].sid);
+                        ++i;
+                    }
+                }
+            }
+        } else {
+            if (srcavail > *count) {
+                if (SRC_SELECT_ROTATE == selection)
+                    start = atomic_fetch_add_explicit(&f->src_cursor, *count, memory_order_relaxed) % srcavail;
+                else if (SRC_SELECT_RANDOM == selection)
+                    start = get_random_uint32() % srcavail;
+            }
+
+            // window starting from start, wrapped around to the beginning
+            for (j = start; (i < *count) && (i < srcavail); ++i) {
+                sources[i].ip = GET_SID_ID(f->sources[j].sid);
+                sources[i].port = GET_SID_PORT(f->sources[j].sid);
+                if (++j == srcavail)
+                    j = 0;
+            }
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    *count = i;
+    return 1;
+}
+
+void db_get_stats(struct db_stats *stats)
+{
+    // no prepared statements here
+    memset(stats, 0, sizeof(*stats));
+}
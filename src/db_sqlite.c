@@ -1,7 +1,9 @@
 #include "db.h"
 #include <string.h>
+#include <pthread.h>
 
 #include "sqlite3/sqlite3.h"
+#include "atomic.h"
 #include "ed2k_proto.h"
 #include "packet.h"
 #include "log.h"
@@ -22,19 +24,27 @@ static uint64_t sdbm(const unsigned char *str, size_t length)
 #define DB_OPEN_FLAGS           SQLITE_OPEN_CREATE|SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX|SQLITE_OPEN_SHAREDCACHE|SQLITE_OPEN_URI
 #define MAX_SEARCH_QUERY_LEN    1024
 #define MAX_NAME_TERM_LEN       1024
+#define SEARCH_STMT_CACHE_SIZE  16
 
 #define DB_CHECK(x)         if (!(x)) goto failed;
-#define MAKE_FID(x)         sdbm((x), 16)
+// fts4 stores docids as deltas, keep them positive to avoid delta overflow
+#define MAKE_FID(x)         (sdbm((x), 16) & 0x3fffffffffffffffull)
 #define MAKE_SID(x)         ( ((uint64_t)(x)->id<<32) | (uint64_t)(x)->port )
 #define GET_SID_ID(sid)     (uint32_t)((sid)>>32)
 #define GET_SID_PORT(sid)   (uint16_t)(sid)
 
 enum query_statements {
+    TX_BEGIN,
+    TX_COMMIT,
+    TX_ROLLBACK,
     SHARE_UPD,
     SHARE_INS,
     SHARE_SRC,
     REMOVE_SRC,
     GET_SRC,
+    GET_SRC_OFFSET,
+    GET_SRC_COMPLETE,
+    GET_SRCAVAIL,
     STMT_COUNT
 };
 
@@ -44,11 +54,77 @@ s_db;
 static THREAD_LOCAL sqlite3_stmt
 *s_stmt[STMT_COUNT];
 
+/* search constraints, query shape is defined by set of active ones */
+enum search_shape {
+    CONSTR_EXT = 0x0001,
+    CONSTR_CODEC = 0x0002,
+    CONSTR_MINSIZE = 0x0004,
+    CONSTR_MAXSIZE = 0x0008,
+    CONSTR_SRCAVAIL = 0x0010,
+    CONSTR_SRCCOMPLETE = 0x0020,
+    CONSTR_MINBITRATE = 0x0040,
+    CONSTR_MINLENGTH = 0x0080,
+    CONSTR_TYPE = 0x0100
+};
+
+struct search_stmt {
+    /* active constraints */
+    uint32_t mask;
+    /* last use time for lru eviction */
+    uint64_t last_use;
+    /* prepared statement */
+    sqlite3_stmt *stmt;
+};
+
+/* per-thread lru cache of prepared search statements */
+static THREAD_LOCAL struct search_stmt s_search_stmts[SEARCH_STMT_CACHE_SIZE];
+static THREAD_LOCAL uint64_t s_search_clock;
+static atomic_uint64_t s_search_stmt_hits;
+static atomic_uint64_t s_search_stmt_misses;
+
+/* rotating sources cursor */
+static atomic_uint32_t s_source_cursor;
+
+enum write_op {
+    WRITE_SHARE,
+    WRITE_REMOVE
+};
+
+/*
+  All writes go through group commit: writer puts request to the queue,
+  first writer which finds no active leader becomes leader and executes
+  all queued requests in a single transaction, others wait until their
+  requests are done. So there is only one write transaction at a time
+  and offers from several clients share one commit.
+*/
+struct write_request {
+    enum write_op op;
+    /* source id */
+    uint64_t sid;
+    /* files for WRITE_SHARE */
+    const struct pub_file *files;
+    /* files count */
+    size_t count;
+    /* non-zero on success */
+    int result;
+    /* request executed flag (guarded by s_write_mutex) */
+    int done;
+    /* next request in queue */
+    struct write_request *next;
+};
+
+static pthread_mutex_t s_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_write_cond = PTHREAD_COND_INITIALIZER;
+static struct write_request *s_write_head;
+static struct write_request **s_write_tail = &s_write_head;
+static int s_write_leader;
+
 int db_create(void)
 {
     static const char query[] =
             "PRAGMA synchronous = 0;"
-                    "PRAGMA journal_mode = OFF;"
+                    // batch writes are rolled back on failure
+                    "PRAGMA journal_mode = MEMORY;"
 
                     "CREATE TABLE IF NOT EXISTS files ("
                     "   fid INTEGER PRIMARY KEY,"
@@ -74,10 +150,12 @@ int db_create(void)
                     "   fid INTEGER NOT NULL,"
                     "   sid INTEGER NOT NULL,"
                     "   complete INTEGER,"
+                    "   highid INTEGER NOT NULL,"
                     "   rating INTEGER"
                     ");"
+                    // also gives complete and highid sources first without sorting
                     "CREATE INDEX IF NOT EXISTS sources_fid_i"
-                    "   ON sources(fid);"
+                    "   ON sources(fid,complete,highid,sid);"
                     "CREATE INDEX IF NOT EXISTS sources_sid_i"
                     "   ON sources(sid);"
 
@@ -148,17 +226,29 @@ int db_open(void)
     int err;
     const char *tail;
 
+    static const char query_tx_begin[] =
+            "BEGIN";
+    static const char query_tx_commit[] =
+            "COMMIT";
+    static const char query_tx_rollback[] =
+            "ROLLBACK";
     static const char query_share_upd[] =
             "UPDATE files SET name=?,ext=?,size=?,type=?,mlength=?,mbitrate=?,mcodec=? WHERE fid=?";
     static const char query_share_ins[] =
             "INSERT OR REPLACE INTO files(fid,hash,name,ext,size,type,mlength,mbitrate,mcodec) "
                     "   VALUES(?,?,?,?,?,?,?,?,?)";
     static const char query_share_src[] =
-            "INSERT INTO sources(fid,sid,complete,rating) VALUES(?,?,?,?)";
+            "INSERT INTO sources(fid,sid,complete,highid,rating) VALUES(?,?,?,?,?)";
     static const char query_remove_src[] =
             "DELETE FROM sources WHERE sid=?";
     static const char query_get_src[] =
             "SELECT sid FROM sources WHERE fid=? LIMIT ?";
+    static const char query_get_src_offset[] =
+            "SELECT sid FROM sources WHERE fid=? LIMIT ? OFFSET ?";
+    static const char query_get_src_complete[] =
+            "SELECT sid FROM sources WHERE fid=? ORDER BY complete DESC, highid DESC LIMIT ?";
+    static const char query_get_srcavail[] =
+            "SELECT srcavail FROM files WHERE fid=?";
 
     err = sqlite3_open_v2(DB_NAME, &s_db, DB_OPEN_FLAGS, NULL);
     if (SQLITE_OK != err) {
@@ -166,11 +256,21 @@ int db_open(void)
         return 0;
     }
 
+    // don't block readers while group commit transaction is open, rows of
+    // failed requests may be seen before rollback, callers invalidate caches then
+    DB_CHECK(SQLITE_OK == sqlite3_exec(s_db, "PRAGMA read_uncommitted = 1", NULL, NULL, NULL));
+
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_tx_begin, sizeof(query_tx_begin), &s_stmt[TX_BEGIN], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_tx_commit, sizeof(query_tx_commit), &s_stmt[TX_COMMIT], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_tx_rollback, sizeof(query_tx_rollback), &s_stmt[TX_ROLLBACK], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_share_upd, sizeof(query_share_upd), &s_stmt[SHARE_UPD], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_share_ins, sizeof(query_share_ins), &s_stmt[SHARE_INS], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_share_src, sizeof(query_share_src), &s_stmt[SHARE_SRC], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_remove_src, sizeof(query_remove_src), &s_stmt[REMOVE_SRC], &tail));
     DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_get_src, sizeof(query_get_src), &s_stmt[GET_SRC], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_get_src_offset, sizeof(query_get_src_offset), &s_stmt[GET_SRC_OFFSET], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_get_src_complete, sizeof(query_get_src_complete), &s_stmt[GET_SRC_COMPLETE], &tail));
+    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query_get_srcavail, sizeof(query_get_srcavail), &s_stmt[GET_SRCAVAIL], &tail));
 
     return 1;
 
@@ -193,13 +293,18 @@ int db_close(void)
             sqlite3_finalize(s_stmt[i]);
     }
 
+    for (i = 0; i < SEARCH_STMT_CACHE_SIZE; ++i) {
+        if (s_search_stmts[i].stmt) {
+            sqlite3_finalize(s_search_stmts[i].stmt);
+            s_search_stmts[i].stmt = NULL;
+        }
+    }
+
     return SQLITE_OK == sqlite3_close(s_db);
 }
 
-int db_share_files(const struct pub_file *files, size_t count, const struct client *owner)
+static int share_files(const struct pub_file *files, size_t count, uint64_t sid)
 {
-    /* todo: do it in transaction */
-
     while (count-- > 0) {
         sqlite3_stmt *stmt;
         const char *ext;
@@ -254,8 +359,10 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
         stmt = s_stmt[SHARE_SRC];
         DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i++, fid));
-        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i++, MAKE_SID(owner)));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, i++, sid));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->complete));
+        // sid is signed in db, highids with top bit set would sort below lowids
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, GET_SID_ID(sid) >= MAX_LOWID));
         DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, i++, files->rating));
         DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
 
@@ -269,12 +376,12 @@ int db_share_files(const struct pub_file *files, size_t count, const struct clie
     return 0;
 }
 
-int db_remove_source(const struct client *clnt)
+static int remove_source(uint64_t sid)
 {
     sqlite3_stmt *stmt = s_stmt[REMOVE_SRC];
 
     DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
-    DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, MAKE_SID(clnt)));
+    DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, sid));
     DB_CHECK(SQLITE_DONE == sqlite3_step(stmt));
     return 1;
 
@@ -283,12 +390,215 @@ int db_remove_source(const struct client *clnt)
     return 0;
 }
 
-int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *count)
+static int exec_stmt(enum query_statements idx)
 {
-    int err;
+    return (SQLITE_OK == sqlite3_reset(s_stmt[idx])) && (SQLITE_DONE == sqlite3_step(s_stmt[idx]));
+}
+
+static int write_request_exec(const struct write_request *req)
+{
+    if (WRITE_SHARE == req->op)
+        return share_files(req->files, req->count, req->sid);
+    else
+        return remove_source(req->sid);
+}
+
+/**
+@brief executes requests in a single transaction, failed transaction is rolled back as a whole
+@param batch  requests list
+@param limit  maximum requests count to execute
+@return non-zero on success
+*/
+static int write_tx(struct write_request *batch, size_t limit)
+{
+    struct write_request *req;
+    int ok = exec_stmt(TX_BEGIN);
+
+    for (req = batch; ok && req && limit; req = req->next, --limit)
+        ok = write_request_exec(req);
+
+    if (ok)
+        ok = exec_stmt(TX_COMMIT);
+
+    if (!ok && !sqlite3_get_autocommit(s_db))
+        exec_stmt(TX_ROLLBACK);
+
+    return ok;
+}
+
+static void write_batch(struct write_request *batch)
+{
+    struct write_request *req;
+
+    if (write_tx(batch, SIZE_MAX)) {
+        for (req = batch; req; req = req->next)
+            req->result = 1;
+        return;
+    }
+
+    ED2KD_LOGERR("failed to commit db write batch (%s)", sqlite3_errmsg(s_db));
+
+    // nothing of failed batch is left, so one bad request doesn't fail others
+    if (batch->next) {
+        for (req = batch; req; req = req->next)
+            req->result = write_tx(req, 1);
+    } else {
+        batch->result = 0;
+    }
+}
+
+/**
+@brief executes write request as part of group commit
+@return non-zero on success
+*/
+static int db_write(struct write_request *req)
+{
+    req->result = 0;
+    req->done = 0;
+    req->next = NULL;
+
+    pthread_mutex_lock(&s_write_mutex);
+
+    *s_write_tail = req;
+    s_write_tail = &req->next;
+
+    while (!req->done) {
+        if (!s_write_leader) {
+            struct write_request *batch = s_write_head;
+
+            s_write_head = NULL;
+            s_write_tail = &s_write_head;
+            s_write_leader = 1;
+            pthread_mutex_unlock(&s_write_mutex);
+
+            write_batch(batch);
+
+            pthread_mutex_lock(&s_write_mutex);
+            while (batch) {
+                struct write_request *next = batch->next;
+                // request belongs to waiting thread stack, don't touch it after this
+                batch->done = 1;
+                batch = next;
+            }
+            s_write_leader = 0;
+            pthread_cond_broadcast(&s_write_cond);
+        } else {
+            pthread_cond_wait(&s_write_cond, &s_write_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&s_write_mutex);
+
+    return req->result;
+}
+
+int db_share_files(const struct pub_file *files, size_t count, const struct client *owner)
+{
+    struct write_request req;
+
+    req.op = WRITE_SHARE;
+    req.sid = MAKE_SID(owner);
+    req.files = files;
+    req.count = count;
+
+    return db_write(&req);
+}
+
+int db_remove_source(const struct client *owner)
+{
+    struct write_request req;
+
+    req.op = WRITE_REMOVE;
+    req.sid = MAKE_SID(owner);
+    req.files = NULL;
+    req.count = 0;
+
+    return db_write(&req);
+}
+
+/**
+@brief finds prepared search statement for constraints set or prepares new one
+@param mask  active constraints
+@return statement or NULL on failure
+*/
+static sqlite3_stmt *get_search_stmt(uint32_t mask)
+{
+    struct search_stmt *entry = &s_search_stmts[0];
     const char *tail;
+    size_t i;
+    char query[MAX_SEARCH_QUERY_LEN + 1] =
+            " SELECT f.hash,f.name,f.size,f.type,f.ext,f.srcavail,f.srccomplete,f.rating,f.rated_count,"
+                    "  (SELECT sid FROM sources WHERE fid=f.fid LIMIT 1) AS sid,"
+                    "  f.mlength,f.mbitrate,f.mcodec "
+                    " FROM fnames n"
+                    " JOIN files f ON f.fid = n.docid"
+                    " WHERE fnames MATCH ?";
+
+    for (i = 0; i < SEARCH_STMT_CACHE_SIZE; ++i) {
+        struct search_stmt *cur = &s_search_stmts[i];
+
+        if (cur->stmt && (cur->mask == mask)) {
+            cur->last_use = ++s_search_clock;
+            atomic_fetch_add_explicit(&s_search_stmt_hits, 1, memory_order_relaxed);
+            return cur->stmt;
+        }
+
+        // empty slot or least recently used one
+        if (entry->stmt && (!cur->stmt || (cur->last_use < entry->last_use)))
+            entry = cur;
+    }
+
+    atomic_fetch_add_explicit(&s_search_stmt_misses, 1, memory_order_relaxed);
+
+    if (mask & CONSTR_EXT) {
+        strcat(query, " AND f.ext=?");
+    }
+    if (mask & CONSTR_CODEC) {
+        strcat(query, " AND f.mcodec=?");
+    }
+    if (mask & CONSTR_MINSIZE) {
+        strcat(query, " AND f.size>?");
+    }
+    if (mask & CONSTR_MAXSIZE) {
+        strcat(query, " AND f.size<?");
+    }
+    if (mask & CONSTR_SRCAVAIL) {
+        strcat(query, " AND f.srcavail>?");
+    }
+    if (mask & CONSTR_SRCCOMPLETE) {
+        strcat(query, " AND f.srccomplete>?");
+    }
+    if (mask & CONSTR_MINBITRATE) {
+        strcat(query, " AND f.mbitrate>?");
+    }
+    if (mask & CONSTR_MINLENGTH) {
+        strcat(query, " AND f.mlength>?");
+    }
+    if (mask & CONSTR_TYPE) {
+        strcat(query, " AND f.type=?");
+    }
+    strcat(query, " LIMIT ?");
+
+    if (entry->stmt) {
+        sqlite3_finalize(entry->stmt);
+        entry->stmt = NULL;
+    }
+
+    if (SQLITE_OK != sqlite3_prepare_v2(s_db, query, strlen(query) + 1, &entry->stmt, &tail))
+        return NULL;
+
+    entry->mask = mask;
+    entry->last_use = ++s_search_clock;
+
+    return entry->stmt;
+}
+
+int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *count, unsigned flags)
+{
+    int err;
     sqlite3_stmt *stmt = 0;
     size_t i;
+    uint32_t mask = 0;
     struct {
         char name_term[MAX_NAME_TERM_LEN + 1];
         size_t name_len;
@@ -302,14 +612,6 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
         struct search_node *codec_node;
         struct search_node *type_node;
     } params;
-    char query[MAX_SEARCH_QUERY_LEN + 1] =
-            " SELECT f.hash,f.name,f.size,f.type,f.ext,f.srcavail,f.srccomplete,f.rating,f.rated_count,"
-                    "  (SELECT sid FROM sources WHERE fid=f.fid LIMIT 1) AS sid,"
-                    "  f.mlength,f.mbitrate,f.mcodec "
-                    " FROM fnames n"
-                    " JOIN files f ON f.fid = n.docid"
-                    " WHERE fnames MATCH ?";
-
     memset(&params, 0, sizeof params);
 
     while (snode) {
@@ -398,36 +700,27 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
         snode = snode->parent;
     }
 
-    if (params.ext_node) {
-        strcat(query, " AND f.ext=?");
-    }
-    if (params.codec_node) {
-        strcat(query, " AND f.mcodec=?");
-    }
-    if (params.minsize) {
-        strcat(query, " AND f.size>?");
-    }
-    if (params.maxsize) {
-        strcat(query, " AND f.size<?");
-    }
-    if (params.srcavail) {
-        strcat(query, " AND f.srcavail>?");
-    }
-    if (params.srccomplete) {
-        strcat(query, " AND f.srccomplete>?");
-    }
-    if (params.minbitrate) {
-        strcat(query, " AND f.mbitrate>?");
-    }
-    if (params.minlength) {
-        strcat(query, " AND f.mlength>?");
-    }
-    if (params.type_node) {
-        strcat(query, " AND f.type=?");
-    }
-    strcat(query, " LIMIT ?");
-
-    DB_CHECK(SQLITE_OK == sqlite3_prepare_v2(s_db, query, strlen(query) + 1, &stmt, &tail));
+    if (params.ext_node)
+        mask |= CONSTR_EXT;
+    if (params.codec_node)
+        mask |= CONSTR_CODEC;
+    if (params.minsize)
+        mask |= CONSTR_MINSIZE;
+    if (params.maxsize)
+        mask |= CONSTR_MAXSIZE;
+    if (params.srcavail)
+        mask |= CONSTR_SRCAVAIL;
+    if (params.srccomplete)
+        mask |= CONSTR_SRCCOMPLETE;
+    if (params.minbitrate)
+        mask |= CONSTR_MINBITRATE;
+    if (params.minlength)
+        mask |= CONSTR_MINLENGTH;
+    if (params.type_node)
+        mask |= CONSTR_TYPE;
+
+    stmt = get_search_stmt(mask);
+    DB_CHECK(stmt);
 
     i = 1;
     DB_CHECK(SQLITE_OK == sqlite3_bind_text(stmt, i++, params.name_term, params.name_len + 1, SQLITE_STATIC));
@@ -500,42 +793,107 @@ int db_search_files(struct search_node *snode, struct evbuffer *buf, size_t *cou
         sfile.media_codec_len = sfile.media_codec_len > MAX_FILEEXT_LEN ? MAX_FILEEXT_LEN : sfile.media_codec_len;
         sfile.media_codec = (const char *) sqlite3_column_text(stmt, col++);
 
-        write_search_file(buf, &sfile);
+        // files_count must match entries in packet, result is dropped as a whole
+        DB_CHECK(write_search_file(buf, &sfile, flags));
 
         ++i;
     }
 
     DB_CHECK((i == *count) || (SQLITE_DONE == err));
 
+    sqlite3_reset(stmt);
+
     *count = i;
     return 1;
 
     failed:
-    if (stmt) sqlite3_finalize(stmt);
     ED2KD_LOGERR("failed perform search query (%s)", sqlite3_errmsg(s_db));
+    if (stmt) sqlite3_reset(stmt);
 
     return 0;
 }
 
-int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8_t *count)
+/**
+@brief appends sources selected by prepared statement
+@param limit  maximum count of sources after append
+@return non-zero on success
+*/
+static int read_sources(sqlite3_stmt *stmt, struct file_source *sources, uint8_t *count, uint8_t limit)
 {
-    sqlite3_stmt *stmt = s_stmt[GET_SRC];
-    uint8_t i;
-    int err;
-
-    DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
-    DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, MAKE_FID(hash)));
-    DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, *count));
+    uint8_t i = *count;
+    int err = SQLITE_DONE;
 
-    i = 0;
-    while (((err = sqlite3_step(stmt)) == SQLITE_ROW) && (i < *count)) {
+    while ((i < limit) && ((err = sqlite3_step(stmt)) == SQLITE_ROW)) {
         uint64_t sid = sqlite3_column_int64(stmt, 0);
         sources[i].ip = GET_SID_ID(sid);
         sources[i].port = GET_SID_PORT(sid);
         ++i;
     }
 
-    DB_CHECK((i == *count) || (SQLITE_DONE == err));
+    *count = i;
+    return (i == limit) || (SQLITE_DONE == err);
+}
+
+int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8_t *count,
+        enum source_selection selection)
+{
+    sqlite3_stmt *stmt;
+    uint64_t fid = MAKE_FID(hash);
+    uint32_t offset = 0;
+    uint8_t i = 0;
+
+    if (SRC_SELECT_COMPLETE == selection) {
+        stmt = s_stmt[GET_SRC_COMPLETE];
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, fid));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, *count));
+        DB_CHECK(read_sources(stmt, sources, &i, *count));
+
+        *count = i;
+        return 1;
+    }
+
+    if ((SRC_SELECT_ROTATE == selection) || (SRC_SELECT_RANDOM == selection)) {
+        uint32_t srcavail = 0;
+
+        stmt = s_stmt[GET_SRCAVAIL];
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, fid));
+        if (SQLITE_ROW == sqlite3_step(stmt))
+            srcavail = sqlite3_column_int(stmt, 0);
+
+        if (srcavail > *count) {
+            // no per-file cursor here, it would turn every lookup into write,
+            // common cursor still spreads load of single hot file
+            if (SRC_SELECT_ROTATE == selection)
+                offset = atomic_fetch_add_explicit(&s_source_cursor, *count, memory_order_relaxed) % srcavail;
+            else
+                offset = get_random_uint32() % srcavail;
+        }
+    }
+
+    // window starting from offset, wrapped around to the beginning
+    if (offset) {
+        stmt = s_stmt[GET_SRC_OFFSET];
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, fid));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, *count));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 3, offset));
+        DB_CHECK(read_sources(stmt, sources, &i, *count));
+    }
+
+    if (i < *count) {
+        uint8_t limit = *count;
+
+        if (offset && (i + offset < limit))
+            limit = i + offset;
+
+        stmt = s_stmt[GET_SRC];
+        DB_CHECK(SQLITE_OK == sqlite3_reset(stmt));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int64(stmt, 1, fid));
+        DB_CHECK(SQLITE_OK == sqlite3_bind_int(stmt, 2, limit - i));
+        DB_CHECK(read_sources(stmt, sources, &i, limit));
+    }
 
     *count = i;
     return 1;
@@ -544,3 +902,9 @@ int db_get_sources(const unsigned char *hash, struct file_source *sources, uint8
     ED2KD_LOGERR("failed to get sources from db (%s)", sqlite3_errmsg(s_db));
     return 0;
 }
+
+void db_get_stats(struct db_stats *stats)
+{
+    stats->search_stmt_hits = atomic_load_explicit(&s_search_stmt_hits, memory_order_relaxed);
+    stats->search_stmt_misses = atomic_load_explicit(&s_search_stmt_misses, memory_order_relaxed);
+}
@@ -226,6 +226,9 @@ enum tag_name {
     TN_COMPLETE_SOURCES = 0x30,
     TN_FILESIZE_HI = 0x3A,
     TN_FILERATING = 0xF7,
+    TN_MEDIA_LENGTH = 0xD3,
+    TN_MEDIA_BITRATE = 0xD4,
+    TN_MEDIA_CODEC = 0xD5,
 
     // OP_SERVERIDENT
             TN_SERVERNAME = 0x01,
@@ -1,74 +1,269 @@
 #include "job.h"
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "server.h"
 #include "client.h"
+#include "packet.h"
+#include "util.h"
 
-void server_read_cb(struct bufferevent *bev, void *ctx)
+/* maximum free jobs cached in pool */
+#define MAX_POOL_FREE_JOBS  4096
+
+/* every pooled job has size of the largest job type */
+union job_slot {
+    struct job job;
+    struct job_event event;
+};
+
+/*
+  Each thread allocates jobs from its own pool. Jobs freed by the owner
+  thread go to local free list, jobs freed by other threads (workers)
+  are pushed to lock-free remote list, which is taken by the owner as a
+  whole when local list is empty. Both lists are capped, jobs above the
+  cap are returned to heap.
+*/
+struct job_pool {
+    /* jobs freed by owner thread */
+    struct job *local;
+    /* local free list length */
+    size_t local_count;
+    /* jobs freed by other threads */
+    _Atomic(struct job *) remote;
+    /* remote free list length, may be ahead of list while push is in progress */
+    atomic_size_t remote_count;
+    /* jobs taken from pool */
+    atomic_uint64_t hits;
+    /* jobs allocated from heap */
+    atomic_uint64_t misses;
+    /* coalesced jobs */
+    atomic_uint64_t coalesced;
+    /* next pool in registry */
+    struct job_pool *next;
+};
+
+#define JOB_NEXT(job) ((job)->qentry.tqe_next)
+
+static pthread_mutex_t s_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct job_pool *s_pools;
+static THREAD_LOCAL struct job_pool *s_pool;
+
+static struct job_pool *job_pool_get(void)
 {
-    struct job *job = (struct job *) calloc(1, sizeof *job);
-    (void) bev;
+    if (!s_pool) {
+        s_pool = (struct job_pool *) calloc(1, sizeof(*s_pool));
+        pthread_mutex_lock(&s_pools_mutex);
+        s_pool->next = s_pools;
+        s_pools = s_pool;
+        pthread_mutex_unlock(&s_pools_mutex);
+    }
 
-    job->type = JOB_SERVER_READ;
-    job->clnt = (struct client *) ctx;
+    return s_pool;
+}
 
-    server_add_job(job);
+/**
+@brief makes taken remote list local, frees jobs above the cap
+@param list remote list without its first job
+*/
+static void job_pool_adopt(struct job_pool *pool, struct job *list)
+{
+    struct job *tail = NULL;
+    // first job of taken list is handed out by caller
+    size_t count = 1;
+
+    pool->local = list;
+    pool->local_count = 0;
+
+    while (list && pool->local_count < MAX_POOL_FREE_JOBS) {
+        tail = list;
+        list = JOB_NEXT(list);
+        pool->local_count++;
+    }
+    if (tail)
+        JOB_NEXT(tail) = NULL;
+    count += pool->local_count;
+
+    while (list) {
+        struct job *next = JOB_NEXT(list);
+        free(list);
+        list = next;
+        count++;
+    }
+
+    atomic_fetch_sub(&pool->remote_count, count);
 }
 
-void server_event_cb(struct bufferevent *bev, short events, void *ctx)
+static struct job *job_alloc(enum job_type type, struct client *clnt)
 {
-    struct job_event *job = (struct job_event *) calloc(1, sizeof *job);
-    (void) bev;
+    struct job_pool *pool = job_pool_get();
+    struct job *job = pool->local;
 
-    job->hdr.type = JOB_SERVER_EVENT;
-    job->hdr.clnt = (struct client *) ctx;
-    job->events = events;
+    if (job) {
+        pool->local = JOB_NEXT(job);
+        if (pool->local_count)
+            pool->local_count--;
+    } else {
+        job = atomic_exchange(&pool->remote, NULL);
+        if (job)
+            job_pool_adopt(pool, JOB_NEXT(job));
+    }
 
-    server_add_job((struct job *) job);
+    if (job) {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+        memset(job, 0, sizeof(union job_slot));
+    } else {
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+        job = (struct job *) calloc(1, sizeof(union job_slot));
+    }
+
+    job->type = type;
+    job->clnt = clnt;
+    job->pool = pool;
+
+    return job;
 }
 
-void server_status_notify_cb(evutil_socket_t fd, short events, void *ctx)
+void job_free(struct job *job)
 {
-    struct job *job = (struct job *) calloc(1, sizeof(*job));
-    (void) fd;
-    (void) events;
+    struct job_pool *pool = job->pool;
 
-    job->type = JOB_SERVER_STATUS_NOTIFY;
-    job->clnt = (struct client *) ctx;
+    if (pool == s_pool) {
+        if (pool->local_count < MAX_POOL_FREE_JOBS) {
+            JOB_NEXT(job) = pool->local;
+            pool->local = job;
+            pool->local_count++;
+        } else {
+            free(job);
+        }
+    } else {
+        struct job *head;
 
-    server_add_job(job);
+        if (atomic_fetch_add(&pool->remote_count, 1) >= MAX_POOL_FREE_JOBS) {
+            atomic_fetch_sub(&pool->remote_count, 1);
+            free(job);
+            return;
+        }
+
+        head = atomic_load(&pool->remote);
+        do {
+            JOB_NEXT(job) = head;
+        } while (!atomic_compare_exchange_weak(&pool->remote, &head, job));
+    }
 }
 
-void portcheck_read_cb(struct bufferevent *bev, void *ctx)
+void job_get_stats(struct job_stats *stats)
+{
+    struct job_pool *pool;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&s_pools_mutex);
+    for (pool = s_pools; pool; pool = pool->next) {
+        stats->pool_hits += atomic_load_explicit(&pool->hits, memory_order_relaxed);
+        stats->pool_misses += atomic_load_explicit(&pool->misses, memory_order_relaxed);
+        stats->coalesced += atomic_load_explicit(&pool->coalesced, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&s_pools_mutex);
+}
+
+/**
+@brief sets client's pending flag for job type
+@return non-zero if same job is already pending
+*/
+static int job_coalesce(struct client *clnt, enum job_type type)
+{
+    uint32_t flag = 1u << type;
+
+    if (atomic_fetch_or(&clnt->pending_jobs, flag) & flag) {
+        atomic_fetch_add_explicit(&job_pool_get()->coalesced, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    return 0;
+}
+
+void job_clear_pending(struct job *job)
+{
+    atomic_fetch_and(&job->clnt->pending_jobs, ~(1u << job->type));
+}
+
+static void job_list_free(struct job *job)
+{
+    while (job) {
+        struct job *next = JOB_NEXT(job);
+        free(job);
+        job = next;
+    }
+}
+
+void job_pool_destroy_all(void)
+{
+    pthread_mutex_lock(&s_pools_mutex);
+    while (s_pools) {
+        struct job_pool *pool = s_pools;
+        s_pools = pool->next;
+        job_list_free(pool->local);
+        job_list_free(atomic_load(&pool->remote));
+        free(pool);
+    }
+    pthread_mutex_unlock(&s_pools_mutex);
+}
+
+void server_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct client *clnt = (struct client *) ctx;
+    (void) bev;
+
+    // run-to-completion: process cheap packets right here if no worker owns client
+    if (g_srv.cfg->inline_packets && server_client_acquire(clnt)) {
+        int done;
+
+        packet_cork(clnt->bev);
+        done = server_read_inline(clnt);
+        packet_uncork();
+
+        if (!done && !job_coalesce(clnt, JOB_SERVER_READ))
+            server_add_job(job_alloc(JOB_SERVER_READ, clnt));
+        server_client_release(clnt);
+        return;
+    }
+
+    if (job_coalesce(clnt, JOB_SERVER_READ))
+        return;
+    server_add_job(job_alloc(JOB_SERVER_READ, clnt));
+}
+
+void server_event_cb(struct bufferevent *bev, short events, void *ctx)
 {
-    struct job *job = (struct job *) calloc(1, sizeof(*job));
+    struct job_event *job = (struct job_event *) job_alloc(JOB_SERVER_EVENT, (struct client *) ctx);
     (void) bev;
 
-    job->type = JOB_PORTCHECK_READ;
-    job->clnt = (struct client *) ctx;
+    job->events = events;
 
     server_add_job((struct job *) job);
 }
 
+void portcheck_read_cb(struct bufferevent *bev, void *ctx)
+{
+    (void) bev;
+    if (job_coalesce((struct client *) ctx, JOB_PORTCHECK_READ))
+        return;
+    server_add_job(job_alloc(JOB_PORTCHECK_READ, (struct client *) ctx));
+}
+
 void portcheck_timeout_cb(evutil_socket_t fd, short events, void *ctx)
 {
-    struct job *job = (struct job *) calloc(1, sizeof(*job));
     (void) fd;
     (void) events;
-
-    job->type = JOB_PORTCHECK_TIMEOUT;
-    job->clnt = (struct client *) ctx;
-
-    server_add_job(job);
+    server_add_job(job_alloc(JOB_PORTCHECK_TIMEOUT, (struct client *) ctx));
 }
 
 void portcheck_event_cb(struct bufferevent *bev, short events, void *ctx)
 {
-    struct job_event *job = (struct job_event *) calloc(1, sizeof(*job));
+    struct job_event *job = (struct job_event *) job_alloc(JOB_PORTCHECK_EVENT, (struct client *) ctx);
     (void) bev;
 
-    job->hdr.type = JOB_PORTCHECK_EVENT;
-    job->hdr.clnt = (struct client *) ctx;
     job->events = events;
 
     server_add_job((struct job *) job);
@@ -1,6 +1,7 @@
 #ifndef ED2KD_JOB_H
 #define ED2KD_JOB_H
 
+#include <stdint.h>
 #include "queue.h"
 #include <event2/util.h>
 
@@ -8,11 +9,11 @@ struct sockaddr;
 struct bufferevent;
 struct evconnlistener;
 struct client;
+struct job_pool;
 
 enum job_type {
     JOB_SERVER_EVENT,
     JOB_SERVER_READ,
-    JOB_SERVER_STATUS_NOTIFY,
     JOB_PORTCHECK_EVENT,
     JOB_PORTCHECK_READ,
     JOB_PORTCHECK_TIMEOUT
@@ -22,6 +23,8 @@ struct job {
     enum job_type type;
     struct client *clnt;
     TAILQ_ENTRY(job) qentry;
+    /* pool which owns this job */
+    struct job_pool *pool;
 };
 
 struct job_event {
@@ -31,12 +34,44 @@ struct job_event {
 
 TAILQ_HEAD(job_queue, job);
 
+TAILQ_HEAD(client_queue, client);
+
+/**
+@brief returns job to its owner pool, may be called from any thread
+@param job
+*/
+void job_free(struct job *job);
+
+struct job_stats {
+    /* jobs taken from pools */
+    uint64_t pool_hits;
+    /* jobs allocated from heap */
+    uint64_t pool_misses;
+    /* jobs not enqueued because same job is already pending */
+    uint64_t coalesced;
+};
+
+/**
+@brief collects statistics of all job pools
+@param stats
+*/
+void job_get_stats(struct job_stats *stats);
+
+/**
+@brief marks coalesced job as taken by worker, so next event creates new job
+@param job
+*/
+void job_clear_pending(struct job *job);
+
+/**
+@brief frees all job pools, all threads must be finished
+*/
+void job_pool_destroy_all(void);
+
 void server_read_cb(struct bufferevent *bev, void *ctx);
 
 void server_event_cb(struct bufferevent *bev, short events, void *ctx);
 
-void server_status_notify_cb(evutil_socket_t fd, short events, void *ctx);
-
 void portcheck_read_cb(struct bufferevent *bev, void *ctx);
 
 void portcheck_event_cb(struct bufferevent *bev, short events, void *ctx);
@@ -16,9 +16,18 @@ static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struc
     struct client *clnt;
     struct bufferevent *bev;
 
+    struct io_loop *loop = (struct io_loop *) ctx;
+
     (void) listener;
     (void) socklen;
-    (void) ctx;
+
+#ifndef LEV_OPT_REUSEABLE_PORT
+    {
+        // single listener, spread connections between loops
+        static size_t next_loop;
+        loop = &g_srv.loops[next_loop++ % g_srv.loop_count];
+    }
+#endif
 
     assert(AF_INET == sa->sa_family);
     sa_in = (struct sockaddr_in *) sa;
@@ -27,9 +36,9 @@ static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struc
     // todo: limit connections from same ip
     // todo: block banned ips
 
-    clnt = client_new();
+    clnt = client_new(loop);
 
-    bev = bufferevent_socket_new(g_srv.evbase_tcp, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+    bev = bufferevent_socket_new(loop->evbase, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
     clnt->bev = bev;
     clnt->ip = sa_in->sin_addr.s_addr;
 
@@ -59,6 +68,8 @@ static void accept_error_cb(struct evconnlistener *listener, void *ctx)
 int server_listen(void)
 {
     int ret;
+    size_t i, listeners;
+    unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_THREADSAFE;
     struct sockaddr_in bind_sa;
     int bind_sa_len;
 
@@ -72,18 +83,31 @@ int server_listen(void)
     bind_sa.sin_port = htons(g_srv.cfg->listen_port);
     bind_sa.sin_family = AF_INET;
 
-    g_srv.tcp_listener = evconnlistener_new_bind(g_srv.evbase_main,
-            accept_cb, NULL, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE,
-            g_srv.cfg->listen_backlog, (struct sockaddr *) &bind_sa, sizeof(bind_sa));
-    if (NULL == g_srv.tcp_listener) {
-        int err = EVUTIL_SOCKET_ERROR();
-        ED2KD_LOGERR("failed to start listen on %s:%u, last error: %s", g_srv.cfg->listen_addr, g_srv.cfg->listen_port, evutil_socket_error_to_string(err));
-        return 0;
-    }
+#ifdef LEV_OPT_REUSEABLE_PORT
+    // every loop gets own listening socket, kernel balances connections between them
+    if (g_srv.loop_count > 1)
+        flags |= LEV_OPT_REUSEABLE_PORT;
+    listeners = g_srv.loop_count;
+#else
+    listeners = 1;
+#endif
+
+    for (i = 0; i < listeners; ++i) {
+        struct io_loop *loop = &g_srv.loops[i];
+
+        loop->tcp_listener = evconnlistener_new_bind(loop->evbase,
+                accept_cb, loop, flags,
+                g_srv.cfg->listen_backlog, (struct sockaddr *) &bind_sa, sizeof(bind_sa));
+        if (NULL == loop->tcp_listener) {
+            int err = EVUTIL_SOCKET_ERROR();
+            ED2KD_LOGERR("failed to start listen on %s:%u, last error: %s", g_srv.cfg->listen_addr, g_srv.cfg->listen_port, evutil_socket_error_to_string(err));
+            return 0;
+        }
 
-    evconnlistener_set_error_cb(g_srv.tcp_listener, accept_error_cb);
+        evconnlistener_set_error_cb(loop->tcp_listener, accept_error_cb);
+    }
 
-    ED2KD_LOGNFO("start listening on %s:%u", g_srv.cfg->listen_addr, g_srv.cfg->listen_port);
+    ED2KD_LOGNFO("start listening on %s:%u (%u i/o loops)", g_srv.cfg->listen_addr, g_srv.cfg->listen_port, (unsigned) g_srv.loop_count);
 
     ret = event_base_dispatch(g_srv.evbase_main);
     if (ret < 0)
@@ -92,3 +116,22 @@ int server_listen(void)
     return 1;
 }
 
+void server_enable_listeners(void)
+{
+    size_t i;
+
+    for (i = 0; i < g_srv.loop_count; ++i) {
+        if (g_srv.loops[i].tcp_listener)
+            evconnlistener_enable(g_srv.loops[i].tcp_listener);
+    }
+}
+
+void server_disable_listeners(void)
+{
+    size_t i;
+
+    for (i = 0; i < g_srv.loop_count; ++i) {
+        if (g_srv.loops[i].tcp_listener)
+            evconnlistener_disable(g_srv.loops[i].tcp_listener);
+    }
+}
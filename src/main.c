@@ -14,6 +14,8 @@
 #include "ed2k_proto.h"
 #include "server.h"
 #include "db.h"
+#include "search_cache.h"
+#include "source_cache.h"
 
 struct server_instance g_srv;
 
@@ -53,6 +55,14 @@ static void sigint_cb(evutil_socket_t fd, short what, void *ctx)
     server_stop();
 }
 
+static void sigusr1_cb(evutil_socket_t fd, short what, void *ctx)
+{
+    (void) fd;
+    (void) what;
+    (void) ctx;
+    server_log_stats();
+}
+
 static void display_libevent_info(void)
 {
     int i;
@@ -71,8 +81,7 @@ int main(int argc, char *argv[])
 {
     size_t i;
     int ret, opt, longIndex = 0;
-    struct event *evsig_int;
-    pthread_t tcp_thread, *job_threads;
+    struct event *evsig_int, *evsig_usr1;
 
     if (evutil_secure_rng_init() < 0) {
         ED2KD_LOGERR("failed to seed random number generator");
@@ -113,6 +122,8 @@ int main(int argc, char *argv[])
 
     display_libevent_info();
 
+    evutil_gettimeofday(&g_srv.start_tv, NULL);
+
     ret = evthread_use_pthreads();
     if (ret < 0) {
         ED2KD_LOGERR("failed to init libevent threading model");
@@ -124,39 +135,45 @@ int main(int argc, char *argv[])
         ED2KD_LOGERR("failed to create main event loop");
         return EXIT_FAILURE;
     }
-    g_srv.evbase_tcp = event_base_new();
-    if (NULL == g_srv.evbase_tcp) {
-        ED2KD_LOGERR("failed to create tcp event loop");
+    if (!server_init_loops(g_srv.cfg->io_threads)) {
+        ED2KD_LOGERR("failed to create tcp event loops");
         return EXIT_FAILURE;
     }
 
     evsig_int = evsignal_new(g_srv.evbase_main, SIGINT, sigint_cb, NULL);
     evsignal_add(evsig_int, NULL);
-
-    // common timers timevals
-    g_srv.portcheck_timeout_tv = event_base_init_common_timeout(g_srv.evbase_tcp, &g_srv.cfg->portcheck_timeout_tv);
-    g_srv.status_notify_tv = event_base_init_common_timeout(g_srv.evbase_tcp, &g_srv.cfg->status_notify_tv);
+    evsig_usr1 = evsignal_new(g_srv.evbase_main, SIGUSR1, sigusr1_cb, NULL);
+    evsignal_add(evsig_usr1, NULL);
 
     if (!db_create()) {
         ED2KD_LOGERR("failed to create database");
         return EXIT_FAILURE;
     }
 
-    g_srv.thread_count = omp_get_num_procs() + 1;
+    if (!search_cache_init(g_srv.cfg->search_cache_size, g_srv.cfg->search_cache_ttl)) {
+        ED2KD_LOGERR("failed to init search cache");
+        return EXIT_FAILURE;
+    }
 
-    pthread_cond_init(&g_srv.job_cond, NULL);
-    pthread_mutex_init(&g_srv.job_mutex, NULL);
-    TAILQ_INIT(&g_srv.jqueue);
+    if (!source_cache_init(g_srv.cfg->source_cache_size)) {
+        ED2KD_LOGERR("failed to init source cache");
+        return EXIT_FAILURE;
+    }
 
-    job_threads = (pthread_t *) malloc(g_srv.thread_count * sizeof(*job_threads));
+    if (!server_init_workers(g_srv.cfg->worker_threads ? g_srv.cfg->worker_threads : (size_t) omp_get_num_procs() + 1)) {
+        ED2KD_LOGERR("failed to init job workers");
+        return EXIT_FAILURE;
+    }
 
     // start tcp worker threads
     for (i = 0; i < g_srv.thread_count; ++i) {
-        pthread_create(&job_threads[i], NULL, server_job_worker, NULL);
+        pthread_create(&g_srv.workers[i].thread, NULL, server_job_worker, &g_srv.workers[i]);
     }
 
-    // start tcp dispatch thread
-    pthread_create(&tcp_thread, NULL, server_base_worker, g_srv.evbase_tcp);
+    // start tcp dispatch threads
+    for (i = 0; i < g_srv.loop_count; ++i) {
+        pthread_create(&g_srv.loops[i].thread, NULL, server_base_worker, g_srv.loops[i].evbase);
+    }
 
     // start tcp listen loop
     if (!server_listen()) {
@@ -164,32 +181,36 @@ int main(int argc, char *argv[])
         server_stop();
     }
 
-    pthread_join(tcp_thread, NULL);
-
-    while (EBUSY == pthread_cond_destroy(&g_srv.job_cond)) {
-        pthread_cond_broadcast(&g_srv.job_cond);
-        //pthread_yield();
+    for (i = 0; i < g_srv.loop_count; ++i) {
+        pthread_join(g_srv.loops[i].thread, NULL);
     }
 
-    pthread_mutex_destroy(&g_srv.job_mutex);
+    // wake up idle workers, terminate flag is already set
+    server_wakeup_workers();
 
     for (i = 0; i < g_srv.thread_count; ++i) {
-        pthread_join(job_threads[i], NULL);
+        pthread_join(g_srv.workers[i].thread, NULL);
     }
 
-    free(job_threads);
+    server_free_workers();
+
+    server_log_stats();
 
     // todo: free job queue items
 
-    evconnlistener_free(g_srv.tcp_listener);
+    server_free_loops();
     event_free(evsig_int);
-    event_base_free(g_srv.evbase_tcp);
+    event_free(evsig_usr1);
     event_base_free(g_srv.evbase_main);
 
+    search_cache_destroy();
+    source_cache_destroy();
+
     if (db_destroy() < 0) {
         ED2KD_LOGERR("failed to destroy database");
     }
 
+    job_pool_destroy_all();
     server_free_config();
 
     return EXIT_SUCCESS;
@@ -2,14 +2,213 @@
 
 #include <math.h>       /* floor */
 #include <string.h>     /* memcpy */
+#include <stdlib.h>     /* malloc */
 #include <malloc.h>     /* alloca */
 #include <alloca.h>     /* alloca */
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <zlib.h>
 
+#include "atomic.h"
 #include "ed2k_proto.h"
 #include "server.h"
+#include "util.h"
+
+/* initial size of unpack buffer, it grows up to MAX_UNCOMPRESSED_PACKET_SIZE */
+#define MIN_UNPACK_BUFFER_SIZE  16*1024
+
+/* per-thread inflate state, reset for every packet instead of reallocation */
+static THREAD_LOCAL z_stream s_inflate;
+static THREAD_LOCAL int s_inflate_ready;
+static THREAD_LOCAL unsigned char *s_unpack_buf;
+static THREAD_LOCAL size_t s_unpack_size;
+
+/* per-thread deflate state for outgoing packets */
+static THREAD_LOCAL z_stream s_deflate;
+static THREAD_LOCAL int s_deflate_ready;
+static THREAD_LOCAL unsigned char *s_pack_buf;
+static THREAD_LOCAL size_t s_pack_size;
+
+/* immutable packets built from config, sent by reference */
+struct static_packets {
+    /* previously published set, freed only on exit */
+    struct static_packets *prev;
+    /* welcome message followed by HighID warning if LowID clients are rejected */
+    unsigned char *login;
+    size_t login_len;
+    /* OP_SERVERIDENT */
+    unsigned char *ident;
+    size_t ident_len;
+    unsigned char data[];
+};
+
+static _Atomic(struct static_packets *) s_static;
+
+/* per-thread staging of outgoing packets */
+static THREAD_LOCAL struct evbuffer *s_cork_buf;
+static THREAD_LOCAL struct bufferevent *s_cork_bev;
+
+void packet_cork(struct bufferevent *bev)
+{
+    if (!s_cork_buf) {
+        s_cork_buf = evbuffer_new();
+        if (!s_cork_buf)
+            return;
+    }
+
+    s_cork_bev = bev;
+}
+
+void packet_uncork(void)
+{
+    if (!s_cork_bev)
+        return;
+
+    if (evbuffer_get_length(s_cork_buf))
+        bufferevent_write_buffer(s_cork_bev, s_cork_buf);
+    s_cork_bev = NULL;
+}
+
+static int is_corked(const struct bufferevent *bev)
+{
+    return s_cork_bev && (bev == s_cork_bev);
+}
+
+void packet_cork_flush(struct bufferevent *bev)
+{
+    if (is_corked(bev))
+        packet_uncork();
+}
+
+void packet_cork_free(void)
+{
+    if (s_cork_buf) {
+        evbuffer_free(s_cork_buf);
+        s_cork_buf = NULL;
+    }
+    s_cork_bev = NULL;
+}
+
+struct evbuffer *packet_output(struct bufferevent *bev)
+{
+    return is_corked(bev) ? s_cork_buf : bufferevent_get_output(bev);
+}
+
+static void packet_write(struct bufferevent *bev, const void *data, size_t len)
+{
+    if (is_corked(bev))
+        evbuffer_add(s_cork_buf, data, len);
+    else
+        bufferevent_write(bev, data, len);
+}
+
+static void packet_write_buffer(struct bufferevent *bev, struct evbuffer *buf)
+{
+    if (is_corked(bev))
+        evbuffer_add_buffer(s_cork_buf, buf);
+    else
+        bufferevent_write_buffer(bev, buf);
+}
+
+static size_t message_size(size_t len)
+{
+    return sizeof(struct packet_server_message) + len;
+}
+
+static unsigned char *write_message(unsigned char *dst, const char *msg, uint16_t len)
+{
+    struct packet_server_message data;
+
+    data.hdr.proto = PROTO_EDONKEY;
+    data.hdr.length = sizeof(data) - sizeof(data.hdr) + len;
+    data.opcode = OP_SERVERMESSAGE;
+    data.msg_len = len;
+
+    memcpy(dst, &data, sizeof(data));
+    memcpy(dst + sizeof(data), msg, len);
+
+    return dst + sizeof(data) + len;
+}
+
+static size_t ident_tag_size(size_t len)
+{
+    return len ? sizeof(struct tag_header) + sizeof(uint16_t) + len : 0;
+}
+
+static unsigned char *write_ident_tag(unsigned char *dst, uint8_t name, const char *str, uint16_t len)
+{
+    struct tag_header th;
+
+    if (!len)
+        return dst;
+
+    th.type = TT_STRING;
+    th.name_len = 1;
+    *th.name = name;
+
+    memcpy(dst, &th, sizeof(th));
+    dst += sizeof(th);
+    memcpy(dst, &len, sizeof(len));
+    dst += sizeof(len);
+    memcpy(dst, str, len);
+
+    return dst + len;
+}
+
+int packet_build_static(const struct server_config *cfg)
+{
+    static const char msg_highid[] = "WARNING: Only HighID clients!";
+    struct static_packets *sp;
+    struct packet_server_ident ident;
+    size_t login_len, ident_len;
+    unsigned char *ptr;
+
+    login_len = message_size(cfg->welcome_msg_len);
+    if (!cfg->allow_lowid)
+        login_len += message_size(sizeof(msg_highid) - 1);
+    ident_len = sizeof(ident) + ident_tag_size(cfg->server_name_len) + ident_tag_size(cfg->server_descr_len);
+
+    sp = (struct static_packets *) malloc(sizeof(*sp) + login_len + ident_len);
+    if (!sp)
+        return 0;
+
+    sp->login = sp->data;
+    sp->login_len = login_len;
+    ptr = write_message(sp->login, cfg->welcome_msg, cfg->welcome_msg_len);
+    if (!cfg->allow_lowid)
+        write_message(ptr, msg_highid, sizeof(msg_highid) - 1);
+
+    ident.hdr.proto = PROTO_EDONKEY;
+    ident.hdr.length = ident_len - sizeof(ident.hdr);
+    ident.opcode = OP_SERVERIDENT;
+    memcpy(ident.hash, cfg->hash, sizeof(ident.hash));
+    ident.ip = cfg->listen_addr_inaddr;
+    ident.port = cfg->listen_port;
+    ident.tag_count = (cfg->server_name_len > 0) + (cfg->server_descr_len > 0);
+
+    sp->ident = sp->login + login_len;
+    sp->ident_len = ident_len;
+    memcpy(sp->ident, &ident, sizeof(ident));
+    ptr = write_ident_tag(sp->ident + sizeof(ident), TN_SERVERNAME, cfg->server_name, cfg->server_name_len);
+    write_ident_tag(ptr, TN_DESCRIPTION, cfg->server_descr, cfg->server_descr_len);
+
+    // packets already queued by reference may still point to previous set
+    sp->prev = atomic_exchange(&s_static, sp);
+
+    return 1;
+}
+
+void packet_free_static(void)
+{
+    struct static_packets *sp = atomic_exchange(&s_static, NULL);
+
+    while (sp) {
+        struct static_packets *prev = sp->prev;
+        free(sp);
+        sp = prev;
+    }
+}
 
 void send_id_change(struct bufferevent *bev, uint32_t id)
 {
@@ -21,7 +220,7 @@ void send_id_change(struct bufferevent *bev, uint32_t id)
     data.user_id = id;
     data.tcp_flags = g_srv.cfg->srv_tcp_flags;
 
-    bufferevent_write(bev, &data, sizeof(data));
+    packet_write(bev, &data, sizeof(data));
 }
 
 void send_server_message(struct bufferevent *bev, const char *msg, uint16_t len)
@@ -33,81 +232,37 @@ void send_server_message(struct bufferevent *bev, const char *msg, uint16_t len)
     data.opcode = OP_SERVERMESSAGE;
     data.msg_len = len;
 
-    bufferevent_write(bev, &data, sizeof(data));
-    bufferevent_write(bev, msg, len);
+    packet_write(bev, &data, sizeof(data));
+    packet_write(bev, msg, len);
+}
+
+void write_server_status(struct packet_server_status *data)
+{
+    data->hdr.proto = PROTO_EDONKEY;
+    data->hdr.length = sizeof(*data) - sizeof(data->hdr);
+    data->opcode = OP_SERVERSTATUS;
+    data->user_count = counter_get(&g_srv.user_count);
+    data->file_count = counter_get(&g_srv.file_count);
 }
 
 void send_server_status(struct bufferevent *bev)
 {
     struct packet_server_status data;
 
-    data.hdr.proto = PROTO_EDONKEY;
-    data.hdr.length = sizeof(data) - sizeof(data.hdr);
-    data.opcode = OP_SERVERSTATUS;
-    data.user_count = atomic_load(&g_srv.user_count);
-    data.file_count = atomic_load(&g_srv.file_count);
+    write_server_status(&data);
+    packet_write(bev, &data, sizeof(data));
+}
 
-    bufferevent_write(bev, &data, sizeof(data));
+void send_welcome(struct bufferevent *bev)
+{
+    const struct static_packets *sp = atomic_load(&s_static);
+    evbuffer_add_reference(packet_output(bev), sp->login, sp->login_len, NULL, NULL);
 }
 
 void send_server_ident(struct bufferevent *bev)
 {
-    struct packet_server_ident data;
-
-    data.hdr.proto = PROTO_EDONKEY;
-    data.hdr.length = sizeof(data) - sizeof(data.hdr);
-    data.opcode = OP_SERVERSTATUS;
-    memcpy(data.hash, g_srv.cfg->hash, sizeof(data.hash));
-    data.ip = g_srv.cfg->listen_addr_inaddr;
-    data.port = g_srv.cfg->listen_port;
-    data.tag_count = (g_srv.cfg->server_name_len > 0) + (g_srv.cfg->server_descr_len > 0);
-
-    if (data.tag_count > 0) {
-        struct evbuffer *buf = evbuffer_new();
-        evbuffer_add(buf, &data, sizeof(data));
-
-        if (g_srv.cfg->server_name_len > 0) {
-            struct tag_header th;
-            struct tag_strval *tv;
-            size_t data_len = sizeof(*tv) + g_srv.cfg->server_name_len - 1;
-            tv = (struct tag_strval *) alloca(data_len);
-
-            th.type = TT_STRING;
-            th.name_len = 1;
-            *th.name = TN_SERVERNAME;
-            tv->len = g_srv.cfg->server_name_len;
-            memcpy(tv->str, g_srv.cfg->server_name, g_srv.cfg->server_name_len);
-
-            evbuffer_add(buf, &th, sizeof(th));
-            evbuffer_add(buf, tv, data_len);
-        }
-
-        if (g_srv.cfg->server_descr_len > 0) {
-            struct tag_header th;
-            struct tag_strval *tv;
-            size_t data_len = sizeof(*tv) + g_srv.cfg->server_descr_len - 1;
-            tv = (struct tag_strval *) alloca(data_len);
-
-            th.type = TT_STRING;
-            th.name_len = 1;
-            *th.name = TN_DESCRIPTION;
-            tv->len = g_srv.cfg->server_descr_len;
-            memcpy(tv->str, g_srv.cfg->server_descr, g_srv.cfg->server_descr_len);
-
-            evbuffer_add(buf, &th, sizeof(th));
-            evbuffer_add(buf, tv, data_len);
-        }
-
-        {
-            struct packet_header *ph = (struct packet_header *) evbuffer_pullup(buf, sizeof(*ph));
-            ph->length = evbuffer_get_length(buf) - sizeof(*ph);
-        }
-
-        bufferevent_write_buffer(bev, buf);
-        evbuffer_free(buf);
-    } else {
-        bufferevent_write(bev, &data, sizeof(data));
-    }
+    const struct static_packets *sp = atomic_load(&s_static);
+    evbuffer_add_reference(packet_output(bev), sp->ident, sp->ident_len, NULL, NULL);
 }
 
 void send_server_list(struct bufferevent *bev)
@@ -119,13 +274,13 @@ void send_server_list(struct bufferevent *bev)
 void send_reject(struct bufferevent *bev)
 {
     static const char data[] = {PROTO_EDONKEY, 1, 0, 0, 0, OP_REJECT};
-    bufferevent_write(bev, &data, sizeof(data));
+    packet_write(bev, &data, sizeof(data));
 }
 
 void send_callback_fail(struct bufferevent *bev)
 {
     static const char data[] = {PROTO_EDONKEY, 1, 0, 0, 0, OP_CALLBACK_FAIL};
-    bufferevent_write(bev, &data, sizeof(data));
+    packet_write(bev, &data, sizeof(data));
 }
 
 void send_found_sources(struct bufferevent *bev, const unsigned char *hash, struct file_source *sources, size_t count)
@@ -138,9 +293,9 @@ void send_found_sources(struct bufferevent *bev, const unsigned char *hash, stru
     data.hdr.length = sizeof(data) - sizeof(data.hdr) + srcs_len;
     data.opcode = OP_FOUNDSOURCES;
     data.count = count;
-    bufferevent_write(bev, &data, sizeof(data));
+    packet_write(bev, &data, sizeof(data));
     if (count)
-        bufferevent_write(bev, sources, srcs_len);
+        packet_write(bev, sources, srcs_len);
 }
 
 void send_search_result(struct bufferevent *bev, struct evbuffer *result, size_t count)
@@ -153,150 +308,726 @@ void send_search_result(struct bufferevent *bev, struct evbuffer *result, size_t
     data.files_count = count;
     evbuffer_prepend(result, &data, sizeof(data));
 
-    bufferevent_write_buffer(bev, result);
+    packet_write_buffer(bev, result);
 }
 
-void write_search_file(struct evbuffer *buf, const struct search_file *file)
+/* tag of search result entry */
+struct tag_layout {
+    /* TT_STRING or integer type */
+    uint8_t type;
+    /* numeric name */
+    uint8_t id;
+    /* string name for old style encoding, NULL when numeric name is used */
+    const char *name;
+    /* string value */
+    const char *str;
+    uint16_t str_len;
+    /* integer value */
+    uint64_t val;
+};
+
+static uint8_t int_tag_type(const struct tag_layout *tag, unsigned flags)
 {
-    struct search_file_entry sfe;
+    if (!(flags & SFF_NEWTAGS))
+        return tag->type;
 
-    memcpy(sfe.hash, file->hash, sizeof sfe.hash);
-    sfe.id = file->client_id;
-    sfe.port = file->client_port;
-    sfe.tag_count = 1 + 1 + /*(0!=file->type)+*/ (file->ext_len > 0) + 1 + 1 + (file->rated_count > 0) + (file->media_length > 0) + (file->media_length > 0) + (file->media_codec_len > 0);
-    evbuffer_add(buf, &sfe, sizeof sfe);
-
-    {
-        struct tag_header th;
-        struct tag_strval *tv;
-        size_t data_len = sizeof *tv + file->name_len - 1;
-        tv = (struct tag_strval *) alloca(data_len);
-
-        th.type = TT_STRING;
-        th.name_len = 1;
-        *th.name = TN_FILENAME;
-        tv->len = file->name_len;
-        memcpy(tv->str, file->name, file->name_len);
-
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, tv, data_len);
+    // narrowest type which fits value
+    if (tag->val <= UINT8_MAX)
+        return TT_UINT8;
+    else if (tag->val <= UINT16_MAX)
+        return TT_UINT16;
+    else if (tag->val <= UINT32_MAX)
+        return TT_UINT32;
+    return TT_UINT64;
+}
+
+static size_t int_tag_size(uint8_t type)
+{
+    switch (type) {
+        case TT_UINT8:
+            return sizeof(uint8_t);
+        case TT_UINT16:
+            return sizeof(uint16_t);
+        case TT_UINT32:
+            return sizeof(uint32_t);
+        default:
+            return sizeof(uint64_t);
     }
+}
 
-    {
-        struct tag_header th;
-        th.type = TT_UINT64;
-        th.name_len = 1;
-        *th.name = TN_FILESIZE;
+static int short_str(const struct tag_layout *tag, unsigned flags)
+{
+    return (flags & SFF_NEWTAGS) && (tag->str_len > 0) && (tag->str_len <= 16);
+}
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &file->size, sizeof file->size);
-    }
+static size_t tag_size(const struct tag_layout *tag, unsigned flags)
+{
+    size_t len;
 
-    /*if ( files[i].type ) {
-    struct tag_header th;
-    th.type = TT_STRING;
-    th.name_len = 1;
-    *th.name = TN_FILETYPE;
-    //len
-    //type
-    }*/
+    if ((flags & SFF_NEWTAGS) && !tag->name)
+        len = 2;
+    else
+        len = 1 + sizeof(uint16_t) + (tag->name ? strlen(tag->name) : 1);
 
-    if (file->ext_len) {
-        struct tag_header th;
-        struct tag_strval *tv;
-        size_t data_len = sizeof *tv + file->ext_len - 1;
-        tv = (struct tag_strval *) alloca(data_len);
-
-        th.type = TT_STRING;
-        th.name_len = 1;
-        *th.name = TN_FILEFORMAT;
-        tv->len = file->ext_len;
-        memcpy(tv->str, file->ext, file->ext_len);
-
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, tv, data_len);
-    }
+    if (TT_STRING == tag->type)
+        len += (short_str(tag, flags) ? 0 : sizeof(uint16_t)) + tag->str_len;
+    else
+        len += int_tag_size(int_tag_type(tag, flags));
+
+    return len;
+}
+
+static unsigned char *write_tag(unsigned char *p, const struct tag_layout *tag, unsigned flags)
+{
+    uint8_t type;
 
-    {
-        struct tag_header th;
-        th.type = TT_UINT32;
-        th.name_len = 1;
-        *th.name = TN_SOURCES;
+    if (TT_STRING == tag->type)
+        type = short_str(tag, flags) ? TT_STR1 + tag->str_len - 1 : TT_STRING;
+    else
+        type = int_tag_type(tag, flags);
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &file->srcavail, sizeof file->srcavail);
+    if ((flags & SFF_NEWTAGS) && !tag->name) {
+        *p++ = type | 0x80;
+        *p++ = tag->id;
+    } else {
+        uint16_t name_len = tag->name ? strlen(tag->name) : 1;
+
+        *p++ = type;
+        memcpy(p, &name_len, sizeof(name_len));
+        p += sizeof(name_len);
+        if (tag->name)
+            memcpy(p, tag->name, name_len);
+        else
+            *p = tag->id;
+        p += name_len;
     }
 
-    {
-        struct tag_header th;
-        th.type = TT_UINT32;
-        th.name_len = 1;
-        *th.name = TN_COMPLETE_SOURCES;
+    if (TT_STRING == tag->type) {
+        if (!short_str(tag, flags)) {
+            memcpy(p, &tag->str_len, sizeof(tag->str_len));
+            p += sizeof(tag->str_len);
+        }
+        memcpy(p, tag->str, tag->str_len);
+        p += tag->str_len;
+    } else {
+        size_t len = int_tag_size(type);
+        // little endian, low bytes go first
+        memcpy(p, &tag->val, len);
+        p += len;
+    }
+
+    return p;
+}
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &file->srccomplete, sizeof file->srccomplete);
+int write_search_file(struct evbuffer *buf, const struct search_file *file, unsigned flags)
+{
+    struct tag_layout tags[10];
+    struct search_file_entry sfe;
+    struct evbuffer_iovec vec;
+    size_t i, count = 0, len = sizeof(sfe);
+    unsigned char *p;
+    // new style clients get numeric names of media tags
+    int newtags = flags & SFF_NEWTAGS;
+
+    memset(tags, 0, sizeof(tags));
+
+    tags[count].type = TT_STRING;
+    tags[count].id = TN_FILENAME;
+    tags[count].str = file->name;
+    tags[count].str_len = file->name_len;
+    count++;
+
+    if (flags & SFF_LARGEFILES) {
+        tags[count].type = TT_UINT64;
+        tags[count].id = TN_FILESIZE;
+        tags[count].val = file->size;
+        count++;
+    } else {
+        tags[count].type = TT_UINT32;
+        tags[count].id = TN_FILESIZE;
+        tags[count].val = (uint32_t) file->size;
+        count++;
+
+        if (file->size > UINT32_MAX) {
+            tags[count].type = TT_UINT32;
+            tags[count].id = TN_FILESIZE_HI;
+            tags[count].val = file->size >> 32;
+            count++;
+        }
+    }
+
+    if (file->ext_len) {
+        tags[count].type = TT_STRING;
+        tags[count].id = TN_FILEFORMAT;
+        tags[count].str = file->ext;
+        tags[count].str_len = file->ext_len;
+        count++;
     }
 
+    tags[count].type = TT_UINT32;
+    tags[count].id = TN_SOURCES;
+    tags[count].val = file->srcavail;
+    count++;
+
+    tags[count].type = TT_UINT32;
+    tags[count].id = TN_COMPLETE_SOURCES;
+    tags[count].val = file->srccomplete;
+    count++;
+
     if (file->rated_count > 0) {
         uint16_t data;
-        struct tag_header th;
-        th.type = TT_UINT16;
-        th.name_len = 1;
-        *th.name = TN_FILERATING;
 
         // lo-byte: percentage rated this file
         data = (100 * (uint8_t) ((float) file->srcavail / (float) file->rated_count)) << 8;
         // hi-byte: average rating
         data += ((uint16_t) floor((double) file->rating / (double) file->rated_count + 0.5f) * 51) & 0xFF;
 
-        evbuffer_add(buf, &th, sizeof th);
-        evbuffer_add(buf, &data, sizeof data);
+        tags[count].type = TT_UINT16;
+        tags[count].id = TN_FILERATING;
+        tags[count].val = data;
+        count++;
     }
 
     if (file->media_length) {
-        struct tag_header *th;
-        uint16_t name_len = sizeof(TNS_MEDIA_LENGTH) - 1;
-
-        size_t th_len = sizeof *th + name_len - 1;
-        th = (struct tag_header *) alloca(th_len);
-        th->type = TT_UINT32;
-        th->name_len = name_len;
-        memcpy(th->name, TNS_MEDIA_LENGTH, name_len);
-
-        evbuffer_add(buf, th, th_len);
-        evbuffer_add(buf, &file->media_length, sizeof file->media_length);
+        tags[count].type = TT_UINT32;
+        tags[count].id = TN_MEDIA_LENGTH;
+        tags[count].name = newtags ? NULL : TNS_MEDIA_LENGTH;
+        tags[count].val = file->media_length;
+        count++;
     }
 
     if (file->media_bitrate) {
-        uint16_t name_len = sizeof(TNS_MEDIA_BITRATE) - 1;
-        struct tag_header *th;
-        size_t th_len = sizeof *th + name_len - 1;
-        th = (struct tag_header *) alloca(th_len);
-        th->type = TT_UINT32;
-        th->name_len = name_len;
-        memcpy(th->name, TNS_MEDIA_BITRATE, name_len);
-
-        evbuffer_add(buf, th, th_len);
-        evbuffer_add(buf, &file->media_bitrate, sizeof(file->media_bitrate));
+        tags[count].type = TT_UINT32;
+        tags[count].id = TN_MEDIA_BITRATE;
+        tags[count].name = newtags ? NULL : TNS_MEDIA_BITRATE;
+        tags[count].val = file->media_bitrate;
+        count++;
     }
 
     if (file->media_codec_len) {
-        struct tag_header *th;
-        struct tag_strval *tv;
-        uint16_t name_len = sizeof(TNS_MEDIA_CODEC) - 1;
-        size_t th_len = sizeof(*th) + name_len - 1;
-        size_t tv_len = sizeof(*tv) + file->media_codec_len - 1;
-        th = (struct tag_header *) alloca(th_len);
-        tv = (struct tag_strval *) alloca(tv_len);
-
-        th->type = TT_UINT32;
-        th->name_len = name_len;
-        memcpy(th->name, TNS_MEDIA_CODEC, name_len);
-
-        tv->len = file->media_codec_len;
-        memcpy(tv->str, file->media_codec, file->media_codec_len);
-
-        evbuffer_add(buf, th, th_len);
-        evbuffer_add(buf, tv, tv_len);
+        tags[count].type = TT_STRING;
+        tags[count].id = TN_MEDIA_CODEC;
+        tags[count].name = newtags ? NULL : TNS_MEDIA_CODEC;
+        tags[count].str = file->media_codec;
+        tags[count].str_len = file->media_codec_len;
+        count++;
+    }
+
+    for (i = 0; i < count; ++i) {
+        len += tag_size(&tags[i], flags);
+    }
+
+    // whole entry is written into one contiguous region
+    if ((evbuffer_reserve_space(buf, len, &vec, 1) < 1) || (vec.iov_len < len))
+        return 0;
+
+    memcpy(sfe.hash, file->hash, sizeof sfe.hash);
+    sfe.id = file->client_id;
+    sfe.port = file->client_port;
+    sfe.tag_count = count;
+
+    p = (unsigned char *) vec.iov_base;
+    memcpy(p, &sfe, sizeof sfe);
+    p += sizeof sfe;
+
+    for (i = 0; i < count; ++i) {
+        p = write_tag(p, &tags[i], flags);
+    }
+
+    vec.iov_len = len;
+    return 0 == evbuffer_commit_space(buf, &vec, 1);
+}
+
+#define NAME_IS(name, str) \
+        (memcmp((name), (str), sizeof(str) - 1) == 0)
+
+/**
+@brief maps known string tag name to numeric one, names differ in length
+@return numeric name or 0
+*/
+static uint8_t tag_name_id(const unsigned char *name, uint16_t len)
+{
+    switch (len) {
+        case sizeof(TNS_MEDIA_CODEC) - 1:
+            return NAME_IS(name, TNS_MEDIA_CODEC) ? TN_MEDIA_CODEC : 0;
+        case sizeof(TNS_MEDIA_LENGTH) - 1:
+            return NAME_IS(name, TNS_MEDIA_LENGTH) ? TN_MEDIA_LENGTH : 0;
+        case sizeof(TNS_MEDIA_BITRATE) - 1:
+            return NAME_IS(name, TNS_MEDIA_BITRATE) ? TN_MEDIA_BITRATE : 0;
+        default:
+            return 0;
+    }
+}
+
+int read_tag(struct packet_buffer *pb, struct packet_tag *tag, int newtags)
+{
+    uint8_t type;
+
+    // type and shortest name
+    PB_CHECK(pb_has(pb, sizeof(type) + sizeof(uint16_t)));
+    type = pb_get_uint8(pb);
+
+    if (type & 0x80) {
+        PB_CHECK(newtags);
+        type &= 0x7f;
+        tag->name = pb_get_uint8(pb);
+    } else {
+        uint16_t name_len = pb_get_uint16(pb);
+        const unsigned char *name = pb->ptr;
+
+        PB_SEEK(pb, name_len);
+        tag->name = (1 == name_len) ? *name : tag_name_id(name, name_len);
+    }
+
+    // string length folded into type
+    if ((TT_STR1 <= type) && (TT_STR16 >= type)) {
+        PB_CHECK(newtags);
+        tag->type = TT_STRING;
+        tag->str_len = type - TT_STR1 + 1;
+        tag->str_val = (const char *) pb->ptr;
+        PB_SEEK(pb, tag->str_len);
+        return 1;
+    }
+
+    tag->type = type;
+
+    switch (type) {
+        case TT_STRING:
+            PB_READ_UINT16(pb, tag->str_len);
+            tag->str_val = (const char *) pb->ptr;
+            PB_SEEK(pb, tag->str_len);
+            break;
+
+        case TT_UINT8: {
+            uint8_t val;
+            PB_READ_UINT8(pb, val);
+            tag->int_val = val;
+            break;
+        }
+
+        case TT_UINT16: {
+            uint16_t val;
+            PB_READ_UINT16(pb, val);
+            tag->int_val = val;
+            break;
+        }
+
+        case TT_UINT32: {
+            uint32_t val;
+            PB_READ_UINT32(pb, val);
+            tag->int_val = val;
+            break;
+        }
+
+        case TT_UINT64:
+            PB_READ_UINT64(pb, tag->int_val);
+            break;
+
+        case TT_HASH16:
+            PB_SEEK(pb, ED2K_HASH_SIZE);
+            break;
+
+        case TT_FLOAT32:
+            PB_SEEK(pb, sizeof(float));
+            break;
+
+        default:
+            PB_CHECK(0);
+    }
+
+    return 1;
+
+    malformed:
+    return 0;
+}
+
+static int grow_unpack_buffer(void)
+{
+    size_t size = s_unpack_size ? s_unpack_size * 2 : MIN_UNPACK_BUFFER_SIZE;
+    unsigned char *buf;
+
+    if (s_unpack_size >= MAX_UNCOMPRESSED_PACKET_SIZE)
+        return 0;
+    if (size > MAX_UNCOMPRESSED_PACKET_SIZE)
+        size = MAX_UNCOMPRESSED_PACKET_SIZE;
+
+    buf = (unsigned char *) realloc(s_unpack_buf, size);
+    if (!buf)
+        return 0;
+
+    s_unpack_buf = buf;
+    s_unpack_size = size;
+
+    return 1;
+}
+
+const unsigned char *packet_inflate(const unsigned char *src, size_t src_len, size_t *out_len)
+{
+    size_t len = 0;
+    int ret;
+
+    if (!s_inflate_ready) {
+        memset(&s_inflate, 0, sizeof(s_inflate));
+        if (Z_OK != inflateInit(&s_inflate))
+            return NULL;
+        s_inflate_ready = 1;
+    } else if (Z_OK != inflateReset(&s_inflate)) {
+        return NULL;
+    }
+
+    s_inflate.next_in = (Bytef *) src;
+    s_inflate.avail_in = src_len;
+
+    // buffer grows only when packet doesn't fit, so small packets touch little memory
+    for (;;) {
+        if ((len == s_unpack_size) && !grow_unpack_buffer())
+            return NULL;
+
+        s_inflate.next_out = s_unpack_buf + len;
+        s_inflate.avail_out = s_unpack_size - len;
+
+        ret = inflate(&s_inflate, Z_FINISH);
+        len = s_unpack_size - s_inflate.avail_out;
+
+        if (Z_STREAM_END == ret) {
+            *out_len = len;
+            return s_unpack_buf;
+        }
+
+        // output space is exhausted, anything else is an error
+        if (((Z_OK != ret) && (Z_BUF_ERROR != ret)) || s_inflate.avail_out)
+            return NULL;
+    }
+}
+
+void packet_inflate_free(void)
+{
+    if (s_inflate_ready) {
+        inflateEnd(&s_inflate);
+        s_inflate_ready = 0;
+    }
+    free(s_unpack_buf);
+    s_unpack_buf = NULL;
+    s_unpack_size = 0;
+}
+
+int packet_deflate(struct evbuffer *packet)
+{
+    struct packet_header hdr;
+    struct evbuffer_iovec *vec;
+    size_t len = evbuffer_get_length(packet), skip, packed_len;
+    uint8_t opcode;
+    int n, i, ret;
+
+    if (len <= sizeof(hdr) + 1)
+        return 0;
+
+    if (!s_deflate_ready) {
+        memset(&s_deflate, 0, sizeof(s_deflate));
+        if (Z_OK != deflateInit(&s_deflate, Z_DEFAULT_COMPRESSION))
+            return 0;
+        s_deflate_ready = 1;
+    } else if (Z_OK != deflateReset(&s_deflate)) {
+        return 0;
+    }
+
+    packed_len = deflateBound(&s_deflate, len);
+    if (s_pack_size < packed_len) {
+        unsigned char *buf = (unsigned char *) realloc(s_pack_buf, packed_len);
+        if (!buf)
+            return 0;
+        s_pack_buf = buf;
+        s_pack_size = packed_len;
+    }
+
+    s_deflate.next_out = s_pack_buf;
+    s_deflate.avail_out = s_pack_size;
+
+    // feed chunks as they are, skipping header and opcode
+    n = evbuffer_peek(packet, -1, NULL, NULL, 0);
+    vec = (struct evbuffer_iovec *) alloca(n * sizeof(*vec));
+    evbuffer_peek(packet, -1, NULL, vec, n);
+
+    skip = sizeof(hdr) + 1;
+    for (i = 0; i < n; ++i) {
+        size_t chunk = vec[i].iov_len;
+
+        if (skip >= chunk) {
+            skip -= chunk;
+            continue;
+        }
+
+        s_deflate.next_in = (Bytef *) vec[i].iov_base + skip;
+        s_deflate.avail_in = chunk - skip;
+        skip = 0;
+
+        if (Z_OK != deflate(&s_deflate, Z_NO_FLUSH))
+            return 0;
+    }
+
+    ret = deflate(&s_deflate, Z_FINISH);
+    if (Z_STREAM_END != ret)
+        return 0;
+
+    packed_len = s_pack_size - s_deflate.avail_out;
+    if (packed_len + 1 >= len - sizeof(hdr))
+        return 0;
+
+    evbuffer_copyout(packet, &hdr, sizeof(hdr));
+    evbuffer_drain(packet, sizeof(hdr));
+    evbuffer_remove(packet, &opcode, sizeof(opcode));
+    evbuffer_drain(packet, len);
+
+    hdr.proto = PROTO_PACKED;
+    hdr.length = packed_len + 1;
+    evbuffer_add(packet, &hdr, sizeof(hdr));
+    evbuffer_add(packet, &opcode, sizeof(opcode));
+    evbuffer_add(packet, s_pack_buf, packed_len);
+
+    return 1;
+}
+
+void packet_deflate_free(void)
+{
+    if (s_deflate_ready) {
+        deflateEnd(&s_deflate);
+        s_deflate_ready = 0;
+    }
+    free(s_pack_buf);
+    s_pack_buf = NULL;
+    s_pack_size = 0;
+}
+
+int read_offer_files(struct packet_buffer *pb, int newtags, struct pub_file **files_out, size_t *count_out)
+{
+    size_t i;
+    uint32_t count;
+    struct pub_file *files = NULL, *cur_file;
+
+    PB_READ_UINT32(pb, count);
+    PB_CHECK(count <= MAX_OFFER_FILES);
+
+    // clients send empty offer too, calloc(0) may return NULL
+    if (!count) {
+        *files_out = NULL;
+        *count_out = 0;
+        return 1;
+    }
+
+    i = count;
+    // todo: limit total files count on server
+
+    cur_file = files = (struct pub_file *) calloc(count, sizeof(*files));
+    PB_CHECK(files);
+
+    while (i-- > 0) {
+        uint32_t tag_count, id;
+        uint16_t port;
+
+        // hash 16b, client id 4b, client port 2b, tag count 4b
+        PB_CHECK(pb_has(pb, sizeof(cur_file->hash) + sizeof(id) + sizeof(port) + sizeof(tag_count)));
+        pb_get_bytes(pb, cur_file->hash, sizeof(cur_file->hash));
+        id = pb_get_uint32(pb);
+        port = pb_get_uint16(pb);
+
+        if ((0xfbfbfbfb == id) && (0xfbfb == port)) {
+            cur_file->complete = 1;
+        }
+
+        tag_count = pb_get_uint32(pb);
+
+        for (; tag_count > 0; --tag_count) {
+            struct packet_tag tag;
+
+            PB_CHECK(read_tag(pb, &tag, newtags));
+
+            switch (tag.name) {
+                case TN_FILENAME:
+                    PB_CHECK(TT_STRING == tag.type);
+                    cur_file->name_len = tag.str_len > MAX_FILENAME_LEN ? MAX_FILENAME_LEN : tag.str_len;
+                    memcpy(cur_file->name, tag.str_val, cur_file->name_len);
+                    cur_file->name[cur_file->name_len] = 0;
+                    break;
+
+                // low and high parts may come in any order
+                case TN_FILESIZE:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->size += tag.int_val;
+                    break;
+
+                case TN_FILESIZE_HI:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->size += tag.int_val << 32;
+                    break;
+
+                case TN_FILERATING:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->rating = tag.int_val > 5 ? 5 : tag.int_val;
+                    break;
+
+                case TN_FILETYPE:
+                    if (TAG_IS_INT(&tag)) {
+                        cur_file->type = tag.int_val;
+                    } else if (TT_STRING == tag.type) {
+                        cur_file->type = get_ed2k_file_type(tag.str_val, tag.str_len);
+                    } else {
+                        PB_CHECK(0);
+                    }
+                    break;
+
+                case TN_MEDIA_LENGTH:
+                    // todo: support string values ( hh:mm:ss )
+                    if (TAG_IS_INT(&tag)) {
+                        cur_file->media_length = tag.int_val;
+                    } else {
+                        PB_CHECK(TT_STRING == tag.type);
+                    }
+                    break;
+
+                case TN_MEDIA_BITRATE:
+                    PB_CHECK(TAG_IS_INT(&tag));
+                    cur_file->media_bitrate = tag.int_val;
+                    break;
+
+                case TN_MEDIA_CODEC:
+                    PB_CHECK(TT_STRING == tag.type);
+                    cur_file->media_codec_len = tag.str_len > MAX_MCODEC_LEN ? MAX_MCODEC_LEN : tag.str_len;
+                    memcpy(cur_file->media_codec, tag.str_val, cur_file->media_codec_len);
+                    cur_file->media_codec[cur_file->media_codec_len] = 0;
+                    break;
+
+                default:
+                    // unknown tags are already consumed by read_tag()
+                    break;
+            }
+        }
+
+        cur_file++;
     }
+
+    *files_out = files;
+    *count_out = count;
+    return 1;
+
+    malformed:
+    free(files);
+    return 0;
+}
+
+int read_search_tree(struct packet_buffer *pb, struct search_node *nodes, size_t max_nodes)
+{
+    struct search_node *n = &nodes[0];
+    size_t used = 1;
+
+    memset(n, 0, sizeof(*n));
+
+    while (n) {
+        if ((ST_AND <= n->type) && (ST_NOT >= n->type)) {
+            if (!n->left) {
+                struct search_node *new_node = &nodes[used++];
+                PB_CHECK(used <= max_nodes);
+                memset(new_node, 0, sizeof(struct search_node));
+                new_node->parent = n;
+                n->left = new_node;
+                n = new_node;
+                continue;
+            } else if (!n->right) {
+                struct search_node *new_node = &nodes[used++];
+                PB_CHECK(used <= max_nodes);
+                memset(new_node, 0, sizeof(struct search_node));
+                new_node->parent = n;
+                n->right = new_node;
+                n = new_node;
+                continue;
+            } else if (n->left->string_term && n->right->string_term) {
+                n->string_term = 1;
+            }
+        } else if (ST_EMPTY == n->type) {
+            uint16_t oper = 0xffff;
+            uint8_t type;
+
+            PB_CHECK(pb_has(pb, sizeof(type)));
+            pb_peek_uint16(pb, &oper);
+            type = *pb->ptr;
+
+            if (SO_AND == oper) {
+                n->type = ST_AND;
+                PB_SEEK(pb, sizeof(uint16_t));
+                continue;
+
+            } else if (SO_OR == oper) {
+                n->type = ST_OR;
+                PB_SEEK(pb, sizeof(uint16_t));
+                continue;
+
+            } else if (SO_NOT == oper) {
+                n->type = ST_NOT;
+                PB_SEEK(pb, sizeof(uint16_t));
+                continue;
+
+            } else if (SO_STRING_TERM == type) {
+                n->type = ST_STRING;
+                PB_SEEK(pb, 1);
+                PB_READ_UINT16(pb, n->str_len);
+                n->str_val = (const char *) pb->ptr;
+                PB_SEEK(pb, n->str_len);
+                n->string_term = 1;
+
+            } else if (SO_STRING_CONSTR == type) {
+                uint16_t tail1;
+                uint8_t tail2;
+                PB_SEEK(pb, 1);
+                PB_READ_UINT16(pb, n->str_len);
+                n->str_val = (const char *) pb->ptr;
+                PB_SEEK(pb, n->str_len);
+                PB_READ_UINT16(pb, tail1);
+                PB_READ_UINT8(pb, tail2);
+                // todo: add macro for this magic constants
+                if ((0x0001 == tail1) && (0x04 == tail2)) {
+                    n->type = ST_EXTENSION;
+                } else if ((0x0001 == tail1) && (0xd5 == tail2)) {
+                    n->type = ST_CODEC;
+                } else if ((0x0001 == tail1) && (0x03 == tail2)) {
+                    n->type = ST_TYPE;
+                } else {
+                    PB_CHECK(0);
+                }
+
+            } else if ((SO_UINT32 == type) || (SO_UINT64 == type)) {
+                uint32_t constr;
+                PB_SEEK(pb, sizeof(type));
+
+                if (SO_UINT32 == type) {
+                    PB_READ_UINT32(pb, n->int_val);
+                } else {
+                    PB_READ_UINT64(pb, n->int_val);
+                }
+
+                PB_READ_UINT32(pb, constr);
+                if (SC_MINSIZE == constr) {
+                    n->type = ST_MINSIZE;
+                } else if (SC_MAXSIZE == constr) {
+                    n->type = ST_MAXSIZE;
+                } else if (SC_SRCAVAIL == constr) {
+                    n->type = ST_SRCAVAIL;
+                } else if (SC_SRCCMPLETE == constr) {
+                    n->type = ST_SRCCOMLETE;
+                } else if (SC_MINBITRATE == constr) {
+                    n->type = ST_MINBITRATE;
+                } else if (SC_MINLENGTH == constr) {
+                    n->type = ST_MINLENGTH;
+                } else {
+                    PB_CHECK(0);
+                }
+            }
+
+        }
+
+        n = n->parent;
+    }
+
+    return 1;
+
+    malformed:
+    return 0;
 }
@@ -3,10 +3,15 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 struct bufferevent;
 struct evbuffer;
 struct file_source;
+struct server_config;
+struct packet_server_status;
+struct pub_file;
+struct search_node;
 
 struct search_file {
     const unsigned char *hash;
@@ -28,12 +33,67 @@ struct search_file {
     uint32_t srccomplete;
 };
 
+/**
+@brief starts staging of packets sent to bev in current thread
+@param bev  output of client owned by current thread
+
+All packets for bev are collected in per-thread buffer and appended to
+bev output at once by packet_uncork(), so a multi packet response takes
+bufferevent lock and wakes event loop only once.
+*/
+void packet_cork(struct bufferevent *bev);
+
+/**
+@brief flushes staged packets to corked bufferevent and stops staging
+*/
+void packet_uncork(void);
+
+/**
+@brief flushes staged packets if bev is corked in current thread, called before bev is freed
+*/
+void packet_cork_flush(struct bufferevent *bev);
+
+/**
+@brief frees per-thread staging buffer, called on thread exit
+*/
+void packet_cork_free(void);
+
+/**
+@brief output buffer for packets to bev, staging buffer if bev is corked
+*/
+struct evbuffer *packet_output(struct bufferevent *bev);
+
+/**
+@brief builds welcome, HighID warning and server ident packets and publishes them
+@param cfg  loaded configuration
+@return non-zero on success
+
+Packets are immutable and sent by reference. Rebuilding replaces
+published set atomically, previous sets are kept until packet_free_static().
+*/
+int packet_build_static(const struct server_config *cfg);
+
+/**
+@brief frees all packet sets built by packet_build_static()
+*/
+void packet_free_static(void);
+
 void send_id_change(struct bufferevent *bev, uint32_t id);
 
 void send_server_message(struct bufferevent *bev, const char *msg, uint16_t len);
 
+/**
+@brief encodes OP_SERVERSTATUS with current counters
+*/
+void write_server_status(struct packet_server_status *data);
+
 void send_server_status(struct bufferevent *bev);
 
+/**
+@brief sends welcome message and HighID warning if LowID clients are rejected
+*/
+void send_welcome(struct bufferevent *bev);
+
 void send_server_ident(struct bufferevent *bev);
 
 void send_server_list(struct bufferevent *bev);
@@ -46,7 +106,46 @@ void send_found_sources(struct bufferevent *bev, const unsigned char *hash, stru
 
 void send_search_result(struct bufferevent *bev, struct evbuffer *result, size_t count);
 
-void write_search_file(struct evbuffer *buf, const struct search_file *file);
+/* write_search_file() flags */
+enum search_file_flags {
+    /* short tag names, TT_STRx strings and narrowest integers */
+    SFF_NEWTAGS = 0x01,
+    /* 64-bit file size, otherwise TN_FILESIZE_HI carries high part */
+    SFF_LARGEFILES = 0x02
+};
+
+/**
+@brief appends search result entry to buffer
+@param flags  search_file_flags
+@return non-zero on success, buffer is left untouched on failure
+*/
+int write_search_file(struct evbuffer *buf, const struct search_file *file, unsigned flags);
+
+/**
+@brief unpacks PROTO_PACKED payload into per-thread buffer
+@param src      compressed data
+@param src_len  compressed data length
+@param out_len  unpacked data length
+@return unpacked data valid until next call in same thread, NULL on failure
+*/
+const unsigned char *packet_inflate(const unsigned char *src, size_t src_len, size_t *out_len);
+
+/**
+@brief frees per-thread inflate state, called on thread exit
+*/
+void packet_inflate_free(void);
+
+/**
+@brief replaces complete packet in buffer with PROTO_PACKED one, if it is smaller
+@param packet  buffer with single packet
+@return non-zero if packet was compressed
+*/
+int packet_deflate(struct evbuffer *packet);
+
+/**
+@brief frees per-thread deflate state, called on thread exit
+*/
+void packet_deflate_free(void);
 
 struct packet_buffer {
     const unsigned char *ptr;
@@ -65,50 +164,169 @@ struct packet_buffer {
         if ( !(stmt) ) goto malformed
 
 #define PB_LEFT(pb) \
-        ((pb)->end - (pb)->ptr)
-
-#define PB_SEEK(pb, off)               \
-        (pb)->ptr += off;                  \
-        PB_CHECK( (pb)->ptr <= (pb)->end )
-
-#define PB_MEMCPY(pb, dst, len)      \
-        memcpy((dst), (pb)->ptr, (len)); \
-        PB_SEEK((pb), (len))
-
-#define PB_READ_UINT8(pb, val)     \
-        (val) = *(uint8_t*)(pb)->ptr;  \
-        PB_SEEK((pb), sizeof(uint8_t))
-
-#define PB_READ_UINT16(pb, val)     \
-        (val) = *(uint16_t*)(pb)->ptr;  \
-        PB_SEEK((pb), sizeof(uint16_t))
-
-#define PB_READ_UINT32(pb, val)     \
-        (val) = *(uint32_t*)(pb)->ptr;  \
-        PB_SEEK((pb), sizeof(uint32_t))
-
-#define PB_READ_UINT64(pb, val)     \
-        (val) = *(uint64_t*)(pb)->ptr;  \
-        PB_SEEK((pb), sizeof(uint64_t))
-
-#define PB_PTR_UINT8(pb)        *(uint8_t*)(pb)->ptr
-#define PB_PTR_UINT16(pb)       *(uint16_t*)(pb)->ptr
-#define PB_PTR_UINT32(pb)       *(uint32_t*)(pb)->ptr
-#define PB_PTR_UINT64(pb)       *(uint64_t*)(pb)->ptr
-
-#define PB_READ_STRING(pb, dst, max_len) \
-{    \
-        uint16_t _pb_len;    \
-        PB_READ_UINT16((pb), _pb_len);    \
-        (max_len) = _pb_len > (max_len) ? (max_len) : _pb_len;    \
-        memcpy((dst), pb->ptr, (max_len));    \
-        PB_SEEK(pb, _pb_len);    \
+        ((size_t)((pb)->end - (pb)->ptr))
+
+/*
+  Readers below never touch memory past buffer end: length is checked
+  before access and loads go through memcpy, so they are safe for any
+  alignment and compile to plain moves on x86. Fixed size records should
+  be checked once with pb_has() and then read with unchecked pb_get_*().
+*/
+
+/**
+@return non-zero if at least len bytes left
+*/
+static inline int pb_has(const struct packet_buffer *pb, size_t len)
+{
+    return PB_LEFT(pb) >= len;
+}
+
+/**
+@brief moves pointer forward
+@return zero if less than off bytes left, pointer is not moved then
+*/
+static inline int pb_seek(struct packet_buffer *pb, size_t off)
+{
+    if (__builtin_expect(!pb_has(pb, off), 0))
+        return 0;
+    pb->ptr += off;
+    return 1;
+}
+
+static inline uint8_t pb_get_uint8(struct packet_buffer *pb)
+{
+    return *pb->ptr++;
 }
 
-#define PB_SKIP_TAGHDR_INT(pb) \
-        PB_SEEK((pb), sizeof(uint8_t)*2)
+static inline uint16_t pb_get_uint16(struct packet_buffer *pb)
+{
+    uint16_t val;
+    memcpy(&val, pb->ptr, sizeof(val));
+    pb->ptr += sizeof(val);
+    return val;
+}
+
+static inline uint32_t pb_get_uint32(struct packet_buffer *pb)
+{
+    uint32_t val;
+    memcpy(&val, pb->ptr, sizeof(val));
+    pb->ptr += sizeof(val);
+    return val;
+}
+
+static inline uint64_t pb_get_uint64(struct packet_buffer *pb)
+{
+    uint64_t val;
+    memcpy(&val, pb->ptr, sizeof(val));
+    pb->ptr += sizeof(val);
+    return val;
+}
+
+static inline void pb_get_bytes(struct packet_buffer *pb, void *dst, size_t len)
+{
+    memcpy(dst, pb->ptr, len);
+    pb->ptr += len;
+}
+
+/**
+@brief peeks value without moving pointer
+@return zero if not enough bytes left
+*/
+static inline int pb_peek_uint16(const struct packet_buffer *pb, uint16_t *val)
+{
+    if (!pb_has(pb, sizeof(*val)))
+        return 0;
+    memcpy(val, pb->ptr, sizeof(*val));
+    return 1;
+}
+
+#define PB_SEEK(pb, off) \
+        PB_CHECK( pb_seek((pb), (off)) )
+
+#define PB_MEMCPY(pb, dst, len) do {        \
+        PB_CHECK( pb_has((pb), (len)) );    \
+        pb_get_bytes((pb), (dst), (len));   \
+    } while (0)
+
+#define PB_READ_UINT8(pb, val) do {                 \
+        PB_CHECK( pb_has((pb), sizeof(uint8_t)) );  \
+        (val) = pb_get_uint8(pb);                   \
+    } while (0)
+
+#define PB_READ_UINT16(pb, val) do {                \
+        PB_CHECK( pb_has((pb), sizeof(uint16_t)) ); \
+        (val) = pb_get_uint16(pb);                  \
+    } while (0)
+
+#define PB_READ_UINT32(pb, val) do {                \
+        PB_CHECK( pb_has((pb), sizeof(uint32_t)) ); \
+        (val) = pb_get_uint32(pb);                  \
+    } while (0)
+
+#define PB_READ_UINT64(pb, val) do {                \
+        PB_CHECK( pb_has((pb), sizeof(uint64_t)) ); \
+        (val) = pb_get_uint64(pb);                  \
+    } while (0)
+
+#define PB_READ_STRING(pb, dst, max_len) do {                       \
+        uint16_t _pb_len;                                           \
+        PB_READ_UINT16((pb), _pb_len);                              \
+        PB_CHECK( pb_has((pb), _pb_len) );                          \
+        (max_len) = _pb_len > (max_len) ? (max_len) : _pb_len;      \
+        memcpy((dst), (pb)->ptr, (max_len));                        \
+        (pb)->ptr += _pb_len;                                       \
+    } while (0)
+
+/* tag read from packet */
+struct packet_tag {
+    /* TT_STRING for all string encodings, integer and other types as is */
+    uint8_t type;
+    /* numeric name, known string names are mapped to numeric ones, 0 for unknown */
+    uint8_t name;
+    /* integer value of any width */
+    uint64_t int_val;
+    /* string value length */
+    uint16_t str_len;
+    /* string value, points into packet */
+    const char *str_val;
+};
+
+#define TAG_IS_INT(tag) \
+        ((TT_UINT8 == (tag)->type) || (TT_UINT16 == (tag)->type) || \
+         (TT_UINT32 == (tag)->type) || (TT_UINT64 == (tag)->type))
+
+/**
+@brief reads tag in old or new (short name, TT_STRx) format
+@param pb       packet buffer
+@param tag      destination
+@param newtags  non-zero if client advertised CLI_CAP_NEWTAGS
+@return non-zero on success, zero if tag is malformed
+*/
+int read_tag(struct packet_buffer *pb, struct packet_tag *tag, int newtags);
+
+/* maximum files in one OP_OFFERFILES */
+#define MAX_OFFER_FILES     200
+
+/* maximum nodes of OP_SEARCHREQUEST tree, bounds parser stack and backend recursion */
+#define MAX_SEARCH_NODES    128
+
+/**
+@brief reads OP_OFFERFILES payload
+@param pb         packet buffer
+@param newtags    non-zero if client advertised CLI_CAP_NEWTAGS
+@param files_out  files array, must be freed by caller on success, NULL for empty offer
+@param count_out  files count
+@return non-zero on success, zero if packet is malformed
+*/
+int read_offer_files(struct packet_buffer *pb, int newtags, struct pub_file **files_out, size_t *count_out);
 
-#define PB_SKIP_TAGHDR(pb, hdr) \
-        PB_SEEK((pb), sizeof(uint8_t)+sizeof(uint16_t)+(hdr)->name_len)
+/**
+@brief reads OP_SEARCHREQUEST payload into search tree
+@param pb         packet buffer
+@param nodes      tree nodes storage, root is the first one
+@param max_nodes  nodes storage size
+@return non-zero on success, zero if packet is malformed or tree is too large
+*/
+int read_search_tree(struct packet_buffer *pb, struct search_node *nodes, size_t max_nodes);
 
 #endif // ED2KD_PACKET_H
@@ -5,7 +5,6 @@
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
-#include <zlib.h>
 
 #include "server.h"
 #include "client.h"
@@ -108,18 +107,16 @@ void portcheck_read(struct client *clnt)
         data += sizeof(struct packet_header);
 
         if (PROTO_PACKED == header->proto) {
-            unsigned long unpacked_len = MAX_UNCOMPRESSED_PACKET_SIZE;
-            unsigned char *unpacked = (unsigned char *) malloc(unpacked_len);
+            size_t unpacked_len;
+            const unsigned char *unpacked = packet_inflate(data + 1, header->length - 1, &unpacked_len);
 
-            ret = uncompress(unpacked, &unpacked_len, data + 1, header->length - 1);
-            if (Z_OK == ret) {
+            if (unpacked) {
                 PB_INIT(&pb, unpacked, unpacked_len);
                 ret = process_packet(&pb, *data, clnt);
             } else {
                 ED2KD_LOGDBG("failed to unpack packet from %s:%u", clnt->dbg.ip_str, clnt->port);
                 ret = 0;
             }
-            free(unpacked);
         } else {
             PB_INIT(&pb, data + 1, header->length - 1);
             ret = process_packet(&pb, *data, clnt);
@@ -0,0 +1,287 @@
+#include "search_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include "uthash/uthash.h"
+#include "queue.h"
+#include "atomic.h"
+#include "db.h"
+
+/*
+  Serialized OP_SEARCHRESULT packets keyed by normalized search tree.
+  Entries are reference counted: buffers which carry entry data by
+  reference keep it alive after eviction. Entry is stale as soon as
+  database generation changes. Without ttl generation changes on every
+  database change, with ttl only on forced invalidation, and entry is
+  served until ttl expires regardless of routine shares.
+*/
+
+struct search_cache_entry {
+    /* references from table and buffers */
+    atomic_uint32_t ref_cnt;
+    /* database generation at the moment of search */
+    uint32_t generation;
+    /* creation time */
+    time_t created;
+    /* lru list entry */
+    TAILQ_ENTRY(search_cache_entry) qentry;
+    /* makes this structure hashable */
+    UT_hash_handle hh;
+    /* packet length */
+    size_t len;
+    /* packet, follows key */
+    unsigned char *data;
+    /* key length */
+    size_t key_len;
+    /* key */
+    unsigned char key[];
+};
+
+TAILQ_HEAD(search_cache_lru, search_cache_entry);
+
+static struct {
+    /* guards table and lru list */
+    pthread_mutex_t mutex;
+    /* entries table */
+    struct search_cache_entry *entries;
+    /* most recently used first */
+    struct search_cache_lru lru;
+    /* entries count */
+    size_t count;
+    /* maximum entries count */
+    size_t capacity;
+    /* entry life time */
+    unsigned ttl;
+    /* database generation */
+    atomic_uint32_t generation;
+    /* statistics */
+    atomic_uint64_t hits;
+    atomic_uint64_t misses;
+    atomic_uint64_t evictions;
+} s_cache;
+
+static void entry_unref(struct search_cache_entry *entry)
+{
+    if (1 == atomic_fetch_sub(&entry->ref_cnt, 1))
+        free(entry);
+}
+
+static void entry_unref_cb(const void *data, size_t len, void *arg)
+{
+    (void) data;
+    (void) len;
+    entry_unref((struct search_cache_entry *) arg);
+}
+
+/* must be called with mutex held */
+static void entry_remove(struct search_cache_entry *entry)
+{
+    HASH_DEL(s_cache.entries, entry);
+    TAILQ_REMOVE(&s_cache.lru, entry, qentry);
+    s_cache.count--;
+    atomic_fetch_add_explicit(&s_cache.evictions, 1, memory_order_relaxed);
+    entry_unref(entry);
+}
+
+static int entry_is_stale(const struct search_cache_entry *entry, time_t now)
+{
+    if (s_cache.ttl && (now - entry->created >= (time_t) s_cache.ttl))
+        return 1;
+    return entry->generation != atomic_load(&s_cache.generation);
+}
+
+int search_cache_init(size_t capacity, unsigned ttl)
+{
+    if (pthread_mutex_init(&s_cache.mutex, NULL))
+        return 0;
+
+    s_cache.entries = NULL;
+    TAILQ_INIT(&s_cache.lru);
+    s_cache.count = 0;
+    s_cache.capacity = capacity;
+    s_cache.ttl = ttl;
+
+    return 1;
+}
+
+void search_cache_destroy(void)
+{
+    while (!TAILQ_EMPTY(&s_cache.lru)) {
+        entry_remove(TAILQ_FIRST(&s_cache.lru));
+    }
+
+    pthread_mutex_destroy(&s_cache.mutex);
+}
+
+size_t search_cache_make_key(const struct search_node *root, uint8_t variant, unsigned char *key)
+{
+    const struct search_node *n = root, *prev = NULL, *next;
+    size_t len = 0;
+
+    if (!s_cache.capacity)
+        return 0;
+
+    key[len++] = variant;
+
+    // pre-order walk by parent links, visited flags are left untouched for db
+    while (n) {
+        if ((ST_AND <= n->type) && (ST_NOT >= n->type)) {
+            if (prev == n->parent) {
+                if (len + 2 > MAX_SEARCH_KEY_LEN)
+                    return 0;
+                key[len++] = (unsigned char) n->type;
+                key[len++] = n->string_term;
+                next = n->left;
+            } else if (prev == n->left) {
+                next = n->right;
+            } else {
+                next = n->parent;
+            }
+        } else {
+            if (len + 1 > MAX_SEARCH_KEY_LEN)
+                return 0;
+            key[len++] = (unsigned char) n->type;
+
+            switch (n->type) {
+                case ST_STRING:
+                case ST_EXTENSION:
+                case ST_CODEC:
+                case ST_TYPE: {
+                    size_t i;
+
+                    if (len + sizeof(n->str_len) + n->str_len > MAX_SEARCH_KEY_LEN)
+                        return 0;
+                    memcpy(key + len, &n->str_len, sizeof(n->str_len));
+                    len += sizeof(n->str_len);
+
+                    // name terms are case insensitive in both backends
+                    for (i = 0; i < n->str_len; ++i) {
+                        char c = n->str_val[i];
+                        if ((ST_STRING == n->type) && (c >= 'A') && (c <= 'Z'))
+                            c += 'a' - 'A';
+                        key[len++] = c;
+                    }
+                    break;
+                }
+                case ST_EMPTY:
+                    break;
+                default:
+                    if (len + sizeof(n->int_val) > MAX_SEARCH_KEY_LEN)
+                        return 0;
+                    memcpy(key + len, &n->int_val, sizeof(n->int_val));
+                    len += sizeof(n->int_val);
+            }
+
+            next = n->parent;
+        }
+
+        prev = n;
+        n = next;
+    }
+
+    return len;
+}
+
+uint32_t search_cache_generation(void)
+{
+    return atomic_load(&s_cache.generation);
+}
+
+void search_cache_invalidate(void)
+{
+    // expiring entries don't track routine database changes
+    if (!s_cache.ttl)
+        search_cache_invalidate_force();
+}
+
+void search_cache_invalidate_force(void)
+{
+    if (s_cache.capacity)
+        atomic_fetch_add(&s_cache.generation, 1);
+}
+
+int search_cache_get(const unsigned char *key, size_t key_len, struct evbuffer *out)
+{
+    struct search_cache_entry *entry;
+
+    pthread_mutex_lock(&s_cache.mutex);
+
+    HASH_FIND(hh, s_cache.entries, key, key_len, entry);
+    if (entry) {
+        if (entry_is_stale(entry, time(NULL))) {
+            entry_remove(entry);
+            entry = NULL;
+        } else {
+            TAILQ_REMOVE(&s_cache.lru, entry, qentry);
+            TAILQ_INSERT_HEAD(&s_cache.lru, entry, qentry);
+            atomic_fetch_add(&entry->ref_cnt, 1);
+        }
+    }
+
+    pthread_mutex_unlock(&s_cache.mutex);
+
+    if (!entry) {
+        atomic_fetch_add_explicit(&s_cache.misses, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    if (evbuffer_add_reference(out, entry->data, entry->len, entry_unref_cb, entry) < 0) {
+        entry_unref(entry);
+        atomic_fetch_add_explicit(&s_cache.misses, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&s_cache.hits, 1, memory_order_relaxed);
+    return 1;
+}
+
+void search_cache_put(const unsigned char *key, size_t key_len, uint32_t generation, struct evbuffer *packet)
+{
+    size_t len = evbuffer_get_length(packet);
+    struct search_cache_entry *entry, *old;
+
+    // database was changed during search
+    if (generation != atomic_load(&s_cache.generation))
+        return;
+
+    entry = (struct search_cache_entry *) malloc(sizeof(*entry) + key_len + len);
+    if (!entry)
+        return;
+
+    atomic_init(&entry->ref_cnt, 1);
+    entry->generation = generation;
+    entry->created = time(NULL);
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+    entry->data = entry->key + key_len;
+    entry->len = len;
+    evbuffer_copyout(packet, entry->data, len);
+
+    pthread_mutex_lock(&s_cache.mutex);
+
+    // concurrent search of the same query may be already stored
+    HASH_FIND(hh, s_cache.entries, key, key_len, old);
+    if (old)
+        entry_remove(old);
+
+    while (s_cache.count >= s_cache.capacity) {
+        entry_remove(TAILQ_LAST(&s_cache.lru, search_cache_lru));
+    }
+
+    HASH_ADD(hh, s_cache.entries, key, key_len, entry);
+    TAILQ_INSERT_HEAD(&s_cache.lru, entry, qentry);
+    s_cache.count++;
+
+    pthread_mutex_unlock(&s_cache.mutex);
+}
+
+void search_cache_get_stats(struct search_cache_stats *stats)
+{
+    stats->hits = atomic_load_explicit(&s_cache.hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&s_cache.misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&s_cache.evictions, memory_order_relaxed);
+}
@@ -0,0 +1,94 @@
+#ifndef ED2KD_SEARCH_CACHE_H
+#define ED2KD_SEARCH_CACHE_H
+
+/*
+@file search_cache.h Cache of serialized search results
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* maximum length of normalized search tree key */
+#define MAX_SEARCH_KEY_LEN  512
+
+/* search result packet encoding variants */
+enum search_variant {
+    /* compressed if large enough */
+    SEARCH_PACKED = 0x01,
+    /* new style tags */
+    SEARCH_NEWTAGS = 0x02,
+    /* 64-bit file sizes */
+    SEARCH_LARGEFILES = 0x04
+};
+
+struct evbuffer;
+struct search_node;
+
+struct search_cache_stats {
+    /* searches answered from cache */
+    uint64_t hits;
+    /* searches which required database query */
+    uint64_t misses;
+    /* entries dropped because of capacity limit or staleness */
+    uint64_t evictions;
+};
+
+/**
+@brief initializes cache
+@param capacity  maximum entries count, 0 disables cache
+@param ttl       entry life time in seconds, 0 - entries live until database changes,
+                 otherwise entries live until ttl expires or forced invalidation
+@return non-zero on success
+*/
+int search_cache_init(size_t capacity, unsigned ttl);
+
+/**
+@brief frees all entries, entries still referenced by buffers are freed with them
+*/
+void search_cache_destroy(void);
+
+/**
+@brief serializes search tree into normalized cache key
+@param root     search tree
+@param variant  packet encoding, results of the same search encoded differently are separate entries
+@param key      destination buffer, at least MAX_SEARCH_KEY_LEN bytes
+@return key length, 0 if search is not cacheable
+*/
+size_t search_cache_make_key(const struct search_node *root, uint8_t variant, unsigned char *key);
+
+/**
+@brief current database generation, must be taken before search is performed
+*/
+uint32_t search_cache_generation(void);
+
+/**
+@brief marks all cached results as stale, called on every database change, no-op with ttl
+*/
+void search_cache_invalidate(void);
+
+/**
+@brief marks all cached results as stale regardless of ttl, for changes which must not
+  be served stale (removed sources, rolled back rows)
+*/
+void search_cache_invalidate_force(void);
+
+/**
+@brief appends cached OP_SEARCHRESULT packet to buffer by reference
+@return non-zero if cached result was found
+*/
+int search_cache_get(const unsigned char *key, size_t key_len, struct evbuffer *out);
+
+/**
+@brief stores copy of OP_SEARCHRESULT packet
+@param generation  database generation taken before search
+@param packet      complete packet
+*/
+void search_cache_put(const unsigned char *key, size_t key_len, uint32_t generation, struct evbuffer *packet);
+
+/**
+@brief collects cache statistics
+@param stats
+*/
+void search_cache_get_stats(struct search_cache_stats *stats);
+
+#endif // ED2KD_SEARCH_CACHE_H
@@ -1,17 +1,67 @@
 #include "server.h"
 #include <assert.h>
-#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
-#include <zlib.h>
+#include <event2/listener.h>
 
 #include "ed2k_proto.h"
 #include "packet.h"
 #include "client.h"
 #include "portcheck.h"
 #include "db.h"
+#include "search_cache.h"
+#include "source_cache.h"
 #include "log.h"
+#include "util.h"
+
+/* maximum jobs processed for one client before it goes back to run queue */
+#define MAX_JOBS_PER_DISPATCH   16
+
+/* per-thread buffer for packets which span several input buffer chunks */
+static THREAD_LOCAL unsigned char *s_linear_buf;
+static THREAD_LOCAL size_t s_linear_size;
+
+/**
+@brief returns contiguous packet data, data is copied only when it is fragmented
+@param input  input buffer
+@param len    data length, must not exceed input buffer length
+@return pointer valid until next call or input buffer change, NULL on failure
+*/
+static const unsigned char *server_peek(struct evbuffer *input, size_t len)
+{
+    struct evbuffer_iovec vec;
+
+    if (1 == evbuffer_peek(input, len, NULL, &vec, 1))
+        return (const unsigned char *) vec.iov_base;
+
+    if (s_linear_size < len) {
+        unsigned char *buf = (unsigned char *) realloc(s_linear_buf, len);
+        if (!buf)
+            return NULL;
+        s_linear_buf = buf;
+        s_linear_size = len;
+    }
+
+    evbuffer_copyout(input, s_linear_buf, len);
+
+    atomic_fetch_add_explicit(&g_srv.linearized_packets, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_srv.linearized_bytes, len, memory_order_relaxed);
+
+    return s_linear_buf;
+}
+
+/**
+@brief frees per-thread linearization buffer, called on thread exit
+*/
+static void server_peek_free(void)
+{
+    free(s_linear_buf);
+    s_linear_buf = NULL;
+    s_linear_size = 0;
+}
 
 static void dummy_cb(evutil_socket_t fd, short what, void *ctx)
 {
@@ -25,86 +75,433 @@ void *server_base_worker(void *arg)
     // todo: after moving to libevent 2.1.x replace timer below with EVLOOP_NO_EXIT_ON_EMPTY flag
     struct event_base *evbase = (struct event_base *) arg;
     struct timeval tv = {500, 0};
-    struct event *ev_dummy = event_new(evbase, -1, EV_PERSIST, dummy_cb, 0);
+    struct event *ev_dummy;
+
+    ev_dummy = event_new(evbase, -1, EV_PERSIST, dummy_cb, 0);
     event_add(ev_dummy, &tv);
 
     if (event_base_dispatch(evbase) < 0)
         ED2KD_LOGERR("loop finished with error");
 
     event_free(ev_dummy);
+
+    server_peek_free();
+    packet_inflate_free();
+    packet_deflate_free();
+    packet_cork_free();
+
     return NULL;
 }
 
-void server_add_job(struct job *job)
+static void worker_push(struct job_worker *worker, struct client *clnt)
 {
-    pthread_mutex_lock(&g_srv.job_mutex);
-    client_addref(job->clnt);
-    TAILQ_INSERT_TAIL(&g_srv.jqueue, job, qentry);
-    pthread_mutex_unlock(&g_srv.job_mutex);
-    pthread_cond_signal(&g_srv.job_cond);
+    int idle;
+
+    pthread_mutex_lock(&worker->job_mutex);
+    TAILQ_INSERT_TAIL(&worker->runq, clnt, rqentry);
+    idle = atomic_load(&worker->idle);
+    pthread_mutex_unlock(&worker->job_mutex);
+
+    if (idle) {
+        pthread_cond_signal(&worker->job_cond);
+    } else if (atomic_load(&g_srv.idle_workers)) {
+        // preferred worker is busy, kick an idle one to steal the client
+        size_t i;
+        for (i = 1; i < g_srv.thread_count; ++i) {
+            struct job_worker *w = &g_srv.workers[(worker->idx + i) % g_srv.thread_count];
+            if (atomic_load(&w->idle)) {
+                pthread_mutex_lock(&w->job_mutex);
+                w->kicked = 1;
+                pthread_mutex_unlock(&w->job_mutex);
+                pthread_cond_signal(&w->job_cond);
+                break;
+            }
+        }
+    }
 }
 
-static int process_login_request(struct packet_buffer *pb, struct client *clnt)
+static struct client *worker_pop(struct job_worker *worker)
 {
-    uint32_t tag_count;
+    struct client *clnt;
 
-    // user hash 16b
-    PB_MEMCPY(pb, clnt->hash, sizeof clnt->hash);
+    pthread_mutex_lock(&worker->job_mutex);
+    clnt = TAILQ_FIRST(&worker->runq);
+    if (clnt)
+        TAILQ_REMOVE(&worker->runq, clnt, rqentry);
+    pthread_mutex_unlock(&worker->job_mutex);
 
-    // user id 4b
-    PB_SEEK(pb, sizeof(uint32_t));
+    return clnt;
+}
 
-    // user port 2b
-    PB_READ_UINT16(pb, clnt->port);
+static struct client *worker_steal(struct job_worker *thief)
+{
+    size_t i;
 
-    // tag count 4b
-    PB_READ_UINT32(pb, tag_count);
+    for (i = 1; i < g_srv.thread_count; ++i) {
+        struct job_worker *victim = &g_srv.workers[(thief->idx + i) % g_srv.thread_count];
+        struct client *clnt;
+
+        if (pthread_mutex_trylock(&victim->job_mutex))
+            continue;
+        clnt = TAILQ_LAST(&victim->runq, client_queue);
+        if (clnt)
+            TAILQ_REMOVE(&victim->runq, clnt, rqentry);
+        pthread_mutex_unlock(&victim->job_mutex);
+
+        if (clnt) {
+            // client migrates to the thief
+            atomic_store(&clnt->worker, thief->idx);
+            return clnt;
+        }
+    }
 
-    for (; tag_count > 0; --tag_count) {
-        const struct tag_header *tag_hdr = (struct tag_header *) pb->ptr;
+    return NULL;
+}
 
-        // no new tags allowed here
-        PB_CHECK((tag_hdr->type & 0x80) == 0);
+static struct client *worker_wait(struct job_worker *worker)
+{
+    struct client *clnt = NULL;
+
+    pthread_mutex_lock(&worker->job_mutex);
+    while (!atomic_load(&g_srv.terminate) && !worker->kicked && TAILQ_EMPTY(&worker->runq)) {
+        atomic_store(&worker->idle, 1);
+        atomic_fetch_add(&g_srv.idle_workers, 1);
+        pthread_cond_wait(&worker->job_cond, &worker->job_mutex);
+        atomic_fetch_sub(&g_srv.idle_workers, 1);
+        atomic_store(&worker->idle, 0);
+    }
+    worker->kicked = 0;
+    clnt = TAILQ_FIRST(&worker->runq);
+    if (clnt)
+        TAILQ_REMOVE(&worker->runq, clnt, rqentry);
+    pthread_mutex_unlock(&worker->job_mutex);
+
+    return clnt;
+}
+
+/*
+  Status notifications: instead of timer per client every i/o loop has a
+  wheel of STATUS_WHEEL_SLOTS client lists and one persistent timer. Each
+  tick sends status packet, encoded once, to all clients of current slot
+  right on i/o thread and moves to next slot, so each client is notified
+  once per status notify interval. New clients are put into slot which
+  is notified last.
+
+  In change-driven mode (status_notify_max_interval set) a slot is
+  notified only if user or file count moved by status_change_threshold
+  since the slot was notified last time, or its forced notification time
+  has come. Forced time is shortened by random jitter, and new clients
+  get status right after login and are put into random slot.
+*/
+static int status_changed(uint32_t old_val, uint32_t new_val)
+{
+    uint64_t diff = old_val > new_val ? old_val - new_val : new_val - old_val;
+    return diff && (diff * 100 >= (uint64_t) g_srv.cfg->status_change_threshold * old_val);
+}
+
+static uint64_t status_next_due(uint64_t now_ms)
+{
+    uint64_t interval = g_srv.cfg->status_notify_max_interval;
+
+    if (g_srv.cfg->status_notify_jitter) {
+        uint64_t jitter = interval * g_srv.cfg->status_notify_jitter / 100;
+        interval -= ((uint64_t) get_random_uint32() * jitter) >> 32;
+    }
+
+    return now_ms + interval;
+}
+
+static void status_tick_cb(evutil_socket_t fd, short events, void *ctx)
+{
+    struct io_loop *loop = (struct io_loop *) ctx;
+    struct packet_server_status data;
+    struct status_slot *slot;
+    struct client *clnt;
+    uint64_t sent = 0;
+    (void) fd;
+    (void) events;
+
+    write_server_status(&data);
+
+    pthread_mutex_lock(&loop->status_mutex);
+    slot = &loop->status_wheel[loop->status_slot];
+
+    if (!TAILQ_EMPTY(&slot->clients)) {
+        int due = 1;
+
+        if (g_srv.cfg->status_notify_max_interval) {
+            struct timeval tv;
+            uint64_t now_ms;
+
+            event_base_gettimeofday_cached(loop->evbase, &tv);
+            now_ms = (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+            due = (now_ms >= slot->due_ms) || status_changed(slot->user_count, data.user_count) ||
+                    status_changed(slot->file_count, data.file_count);
+            if (due)
+                slot->due_ms = status_next_due(now_ms);
+        }
+
+        if (due) {
+            slot->user_count = data.user_count;
+            slot->file_count = data.file_count;
+
+            TAILQ_FOREACH(clnt, &slot->clients, wqentry) {
+                bufferevent_write(clnt->bev, &data, sizeof(data));
+                sent++;
+            }
+        }
+    }
+
+    loop->status_slot = (loop->status_slot + 1) % STATUS_WHEEL_SLOTS;
+    pthread_mutex_unlock(&loop->status_mutex);
+
+    if (sent)
+        atomic_fetch_add_explicit(&g_srv.status_packets, sent, memory_order_relaxed);
+}
+
+void server_status_add(struct client *clnt)
+{
+    struct io_loop *loop = clnt->loop;
+    int change_driven = g_srv.cfg->status_notify_max_interval > 0;
+
+    pthread_mutex_lock(&loop->status_mutex);
+    if (clnt->status_slot < 0) {
+        if (change_driven && g_srv.cfg->status_notify_jitter)
+            clnt->status_slot = get_random_uint32() % STATUS_WHEEL_SLOTS;
+        else
+            clnt->status_slot = (loop->status_slot + STATUS_WHEEL_SLOTS - 1) % STATUS_WHEEL_SLOTS;
+        TAILQ_INSERT_TAIL(&loop->status_wheel[clnt->status_slot].clients, clnt, wqentry);
+    }
+    pthread_mutex_unlock(&loop->status_mutex);
+
+    // slot may stay silent up to maximal interval
+    if (change_driven) {
+        send_server_status(clnt->bev);
+        atomic_fetch_add_explicit(&g_srv.status_packets, 1, memory_order_relaxed);
+    }
+}
+
+void server_status_remove(struct client *clnt)
+{
+    struct io_loop *loop = clnt->loop;
 
-        // only int-based tag names
-        PB_CHECK(1 == tag_hdr->name_len);
+    pthread_mutex_lock(&loop->status_mutex);
+    if (clnt->status_slot >= 0) {
+        TAILQ_REMOVE(&loop->status_wheel[clnt->status_slot].clients, clnt, wqentry);
+        clnt->status_slot = -1;
+    }
+    pthread_mutex_unlock(&loop->status_mutex);
+}
+
+int server_init_loops(size_t count)
+{
+    size_t i;
+    struct timeval tick_tv;
+    uint64_t tick_us = ((uint64_t) g_srv.cfg->status_notify_tv.tv_sec * 1000000 +
+            g_srv.cfg->status_notify_tv.tv_usec) / STATUS_WHEEL_SLOTS;
+
+    if (!tick_us)
+        tick_us = 1000;
+    tick_tv.tv_sec = tick_us / 1000000;
+    tick_tv.tv_usec = tick_us % 1000000;
+
+    g_srv.loops = (struct io_loop *) calloc(count, sizeof(*g_srv.loops));
+    if (!g_srv.loops)
+        return 0;
+
+    for (i = 0; i < count; ++i) {
+        struct io_loop *loop = &g_srv.loops[i];
+
+        loop->idx = i;
+        loop->evbase = event_base_new();
+        if (NULL == loop->evbase)
+            return 0;
+        g_srv.loop_count++;
+
+        // common timers timevals
+        loop->portcheck_timeout_tv = event_base_init_common_timeout(loop->evbase, &g_srv.cfg->portcheck_timeout_tv);
+
+        {
+            size_t j;
+
+            pthread_mutex_init(&loop->status_mutex, NULL);
+            for (j = 0; j < STATUS_WHEEL_SLOTS; ++j) {
+                TAILQ_INIT(&loop->status_wheel[j].clients);
+            }
+        }
 
-        PB_SKIP_TAGHDR(pb, tag_hdr);
+        loop->ev_status_tick = event_new(loop->evbase, -1, EV_PERSIST, status_tick_cb, loop);
+        if (!loop->ev_status_tick)
+            return 0;
+        event_add(loop->ev_status_tick, &tick_tv);
+    }
+
+    return 1;
+}
+
+void server_free_loops(void)
+{
+    size_t i;
+
+    for (i = 0; i < g_srv.loop_count; ++i) {
+        struct io_loop *loop = &g_srv.loops[i];
+        if (loop->tcp_listener)
+            evconnlistener_free(loop->tcp_listener);
+        if (loop->ev_status_tick)
+            event_free(loop->ev_status_tick);
+        event_base_free(loop->evbase);
+        pthread_mutex_destroy(&loop->status_mutex);
+    }
+
+    free(g_srv.loops);
+    g_srv.loops = NULL;
+    g_srv.loop_count = 0;
+}
+
+int server_init_workers(size_t count)
+{
+    size_t i;
+
+    if (posix_memalign((void **) &g_srv.workers, CACHE_LINE_SIZE, count * sizeof(*g_srv.workers)))
+        return 0;
+
+    memset(g_srv.workers, 0, count * sizeof(*g_srv.workers));
+    g_srv.thread_count = count;
+
+    for (i = 0; i < count; ++i) {
+        struct job_worker *worker = &g_srv.workers[i];
+        worker->idx = i;
+        pthread_mutex_init(&worker->job_mutex, NULL);
+        pthread_cond_init(&worker->job_cond, NULL);
+        TAILQ_INIT(&worker->runq);
+    }
+
+    return 1;
+}
+
+void server_wakeup_workers(void)
+{
+    size_t i;
+
+    for (i = 0; i < g_srv.thread_count; ++i) {
+        struct job_worker *worker = &g_srv.workers[i];
+        pthread_mutex_lock(&worker->job_mutex);
+        pthread_cond_broadcast(&worker->job_cond);
+        pthread_mutex_unlock(&worker->job_mutex);
+    }
+}
 
-        switch (*tag_hdr->name) {
-            case TN_NAME: {
-                PB_CHECK(TT_STRING == tag_hdr->type);
-                clnt->nick_len = MAX_NICK_LEN;
-                PB_READ_STRING(pb, clnt->nick, clnt->nick_len);
+void server_free_workers(void)
+{
+    size_t i;
+
+    for (i = 0; i < g_srv.thread_count; ++i) {
+        struct job_worker *worker = &g_srv.workers[i];
+        pthread_cond_destroy(&worker->job_cond);
+        pthread_mutex_destroy(&worker->job_mutex);
+    }
+
+    free(g_srv.workers);
+    g_srv.workers = NULL;
+}
+
+int server_client_acquire(struct client *clnt)
+{
+    pthread_mutex_lock(&clnt->job_mutex);
+    if (clnt->scheduled) {
+        pthread_mutex_unlock(&clnt->job_mutex);
+        return 0;
+    }
+    clnt->scheduled = 1;
+    pthread_mutex_unlock(&clnt->job_mutex);
+
+    client_addref(clnt);
+    return 1;
+}
+
+void server_client_release(struct client *clnt)
+{
+    int requeue;
+
+    pthread_mutex_lock(&clnt->job_mutex);
+    requeue = !TAILQ_EMPTY(&clnt->jqueue);
+    if (!requeue)
+        clnt->scheduled = 0;
+    pthread_mutex_unlock(&clnt->job_mutex);
+
+    if (requeue) {
+        // give other clients a chance, reference goes to run queue
+        worker_push(&g_srv.workers[atomic_load(&clnt->worker)], clnt);
+    } else {
+        client_decref(clnt);
+    }
+}
+
+void server_add_job(struct job *job)
+{
+    struct client *clnt = job->clnt;
+    int runnable;
+
+    client_addref(clnt);
+
+    pthread_mutex_lock(&clnt->job_mutex);
+    TAILQ_INSERT_TAIL(&clnt->jqueue, job, qentry);
+    runnable = !clnt->scheduled;
+    clnt->scheduled = 1;
+    pthread_mutex_unlock(&clnt->job_mutex);
+
+    if (runnable) {
+        // run queue holds its own reference
+        client_addref(clnt);
+        worker_push(&g_srv.workers[atomic_load(&clnt->worker)], clnt);
+    }
+}
+
+static int process_login_request(struct packet_buffer *pb, struct client *clnt)
+{
+    uint32_t tag_count;
+
+    // user hash 16b, user id 4b, user port 2b, tag count 4b
+    PB_CHECK(pb_has(pb, sizeof(clnt->hash) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t)));
+    pb_get_bytes(pb, clnt->hash, sizeof(clnt->hash));
+    // user id is assigned by server
+    (void) pb_get_uint32(pb);
+    clnt->port = pb_get_uint16(pb);
+    tag_count = pb_get_uint32(pb);
+
+    for (; tag_count > 0; --tag_count) {
+        struct packet_tag tag;
+
+        // no new tags allowed here
+        PB_CHECK(read_tag(pb, &tag, 0));
+
+        switch (tag.name) {
+            case TN_NAME:
+                PB_CHECK(TT_STRING == tag.type);
+                clnt->nick_len = tag.str_len > MAX_NICK_LEN ? MAX_NICK_LEN : tag.str_len;
+                memcpy(clnt->nick, tag.str_val, clnt->nick_len);
                 clnt->nick[clnt->nick_len] = 0;
                 break;
-            }
 
             case TN_PORT:
-                PB_CHECK(TT_UINT16 == tag_hdr->type);
-                PB_READ_UINT16(pb, clnt->port);
+                PB_CHECK(TT_UINT16 == tag.type);
+                clnt->port = tag.int_val;
                 break;
 
-            case TN_VERSION: {
-                uint32_t ver;
-                PB_CHECK(TT_UINT32 == tag_hdr->type);
-                PB_READ_UINT32(pb, ver);
-                PB_CHECK(EDONKEYVERSION == ver);
+            case TN_VERSION:
+                PB_CHECK(TT_UINT32 == tag.type);
+                PB_CHECK(EDONKEYVERSION == tag.int_val);
                 break;
-            }
 
             case TN_SERVER_FLAGS:
-                PB_CHECK(TT_UINT32 == tag_hdr->type);
-                PB_READ_UINT32(pb, clnt->tcp_flags);
+                PB_CHECK(TT_UINT32 == tag.type);
+                clnt->tcp_flags = tag.int_val;
                 break;
 
-            case TN_EMULE_VERSION: {
-                uint32_t emule_ver;
-                (void) emule_ver;
-                PB_CHECK(TT_UINT32 == tag_hdr->type);
-                PB_READ_UINT32(pb, emule_ver);
+            case TN_EMULE_VERSION:
+                PB_CHECK(TT_UINT32 == tag.type);
                 break;
-            }
 
             default:
                 PB_CHECK(0);
@@ -123,120 +520,13 @@ static int process_login_request(struct packet_buffer *pb, struct client *clnt)
 
 static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
 {
-    size_t i;
-    uint32_t count;
-    struct pub_file *files, *cur_file;
-
-    PB_READ_UINT32(pb, count);
-    PB_CHECK(count <= 200);
-
-    i = count;
-    // todo: limit total files count on server
-
-    cur_file = files = (struct pub_file *) calloc(count, sizeof(*files));
-
-    while (i-- > 0) {
-        uint32_t tag_count, id;
-        uint16_t port;
+    struct pub_file *files;
+    size_t count;
 
-        PB_MEMCPY(pb, cur_file->hash, sizeof(cur_file->hash));
-
-        PB_READ_UINT32(pb, id);
-        PB_READ_UINT16(pb, port);
-
-        if ((0xfbfbfbfb == id) && (0xfbfb == port)) {
-            cur_file->complete = 1;
-        }
-
-        PB_READ_UINT32(pb, tag_count);
-
-        for (; tag_count > 0; --tag_count) {
-            struct tag_header *tag_hdr = (struct tag_header *) pb->ptr;
-
-            // todo: new tags support
-            PB_CHECK((tag_hdr->type & 0x80) == 0);
-
-            PB_SKIP_TAGHDR(pb, tag_hdr);
-
-            // string-named tags
-            if (tag_hdr->name_len > 1) {
-                if (strncmp(TNS_MEDIA_LENGTH, (const char *) tag_hdr->name, tag_hdr->name_len) == 0) {
-                    if (TT_UINT32 == tag_hdr->type) {
-                        PB_READ_UINT32(pb, cur_file->media_length);
-                    } else if (TT_STRING == tag_hdr->type) {
-                        // todo: support string values ( hh:mm:ss )
-                        uint16_t len;
-                        PB_READ_UINT16(pb, len);
-                        PB_SEEK(pb, len);
-                    } else {
-                        PB_CHECK(0);
-                    }
-                } else if (strncmp(TNS_MEDIA_BITRATE, (const char *) tag_hdr->name, tag_hdr->name_len) == 0) {
-                    PB_CHECK(TT_UINT32 == tag_hdr->type);
-                    PB_READ_UINT32(pb, cur_file->media_bitrate);
-                } else if (strncmp(TNS_MEDIA_CODEC, (const char *) tag_hdr->name, tag_hdr->name_len) == 0) {
-                    uint16_t len = MAX_MCODEC_LEN;
-                    PB_CHECK(TT_STRING == tag_hdr->type);
-                    PB_READ_STRING(pb, cur_file->media_codec, len);
-                    cur_file->media_codec[len] = 0;
-                } else {
-                    PB_CHECK(0);
-                }
-            } else {
-                switch (*tag_hdr->name) {
-
-                    case TN_FILENAME:
-                        PB_CHECK(TT_STRING == tag_hdr->type);
-                        PB_READ_UINT16(pb, cur_file->name_len);
-                        cur_file->name_len = cur_file->name_len > MAX_FILENAME_LEN ? MAX_FILENAME_LEN : cur_file->name_len;
-                        PB_MEMCPY(pb, cur_file->name, cur_file->name_len);
-                        cur_file->name[cur_file->name_len] = 0;
-                        break;
-
-                    case TN_FILESIZE:
-                        PB_CHECK(TT_UINT32 == tag_hdr->type);
-                        PB_READ_UINT32(pb, cur_file->size);
-                        break;
-
-                    case TN_FILESIZE_HI: {
-                        uint32_t size_hi;
-                        PB_CHECK(TT_UINT32 == tag_hdr->type);
-                        PB_READ_UINT32(pb, size_hi);
-                        cur_file->size += (uint64_t) size_hi << 32;
-                        break;
-                    }
-
-                    case TN_FILERATING:
-                        PB_CHECK(TT_UINT32 == tag_hdr->type);
-                        PB_READ_UINT32(pb, cur_file->rating);
-                        if (cur_file->rating > 5) {
-                            cur_file->rating = 5;
-                        }
-                        break;
-
-                    case TN_FILETYPE:
-                        if (TT_UINT32 == tag_hdr->type) {
-                            PB_READ_UINT32(pb, cur_file->type);
-                        } else if (TT_STRING == tag_hdr->type) {
-                            uint16_t len;
-                            PB_READ_UINT16(pb, len);
-                            cur_file->type = get_ed2k_file_type((const char *) pb->ptr, len);
-                            PB_SEEK(pb, len);
-                        } else {
-                            PB_CHECK(0);
-                        }
-                        break;
-
-                    default:
-                        PB_CHECK(0);
-                }
-            }
-        }
-
-        cur_file++;
-    }
-
-    client_share_files(clnt, files, count);
+    PB_CHECK(read_offer_files(pb, clnt->tcp_flags & CLI_CAP_NEWTAGS, &files, &count));
+    if (count)
+        client_share_files(clnt, files, count);
+    free(files);
 
     return 1;
 
@@ -246,109 +536,11 @@ static int process_offer_files(struct packet_buffer *pb, struct client *clnt)
 
 static int process_search_request(struct packet_buffer *pb, struct client *clnt)
 {
-    struct search_node *n, root;
-    n = &root;
-
-    memset(&root, 0, sizeof(root));
-
-    while (n) {
-        if ((ST_AND <= n->type) && (ST_NOT >= n->type)) {
-            if (!n->left) {
-                struct search_node *new_node = (struct search_node *) alloca(sizeof(struct search_node));
-                memset(new_node, 0, sizeof(struct search_node));
-                new_node->parent = n;
-                n->left = new_node;
-                n = new_node;
-                continue;
-            } else if (!n->right) {
-                struct search_node *new_node = (struct search_node *) alloca(sizeof(struct search_node));
-                memset(new_node, 0, sizeof(struct search_node));
-                new_node->parent = n;
-                n->right = new_node;
-                n = new_node;
-                continue;
-            } else if (n->left->string_term && n->right->string_term) {
-                n->string_term = 1;
-            }
-        } else if (ST_EMPTY == n->type) {
-            if (SO_AND == PB_PTR_UINT16(pb)) {
-                n->type = ST_AND;
-                PB_SEEK(pb, sizeof(uint16_t));
-                continue;
-
-            } else if (SO_OR == PB_PTR_UINT16(pb)) {
-                n->type = ST_OR;
-                PB_SEEK(pb, sizeof(uint16_t));
-                continue;
-
-            } else if (SO_NOT == PB_PTR_UINT16(pb)) {
-                n->type = ST_NOT;
-                PB_SEEK(pb, sizeof(uint16_t));
-                continue;
-
-            } else if (SO_STRING_TERM == PB_PTR_UINT8(pb)) {
-                n->type = ST_STRING;
-                PB_SEEK(pb, 1);
-                PB_READ_UINT16(pb, n->str_len);
-                n->str_val = (const char *) pb->ptr;
-                PB_SEEK(pb, n->str_len);
-                n->string_term = 1;
-
-            } else if (SO_STRING_CONSTR == PB_PTR_UINT8(pb)) {
-                uint16_t tail1;
-                uint8_t tail2;
-                PB_SEEK(pb, 1);
-                PB_READ_UINT16(pb, n->str_len);
-                n->str_val = (const char *) pb->ptr;
-                PB_SEEK(pb, n->str_len);
-                PB_READ_UINT16(pb, tail1);
-                PB_READ_UINT8(pb, tail2);
-                // todo: add macro for this magic constants
-                if ((0x0001 == tail1) && (0x04 == tail2)) {
-                    n->type = ST_EXTENSION;
-                } else if ((0x0001 == tail1) && (0xd5 == tail2)) {
-                    n->type = ST_CODEC;
-                } else if ((0x0001 == tail1) && (0x03 == tail2)) {
-                    n->type = ST_TYPE;
-                } else {
-                    PB_CHECK(0);
-                }
-
-            } else if ((SO_UINT32 == PB_PTR_UINT8(pb)) || (SO_UINT64 == PB_PTR_UINT8(pb))) {
-                uint32_t constr;
-                uint8_t type;
-                PB_READ_UINT8(pb, type);
-
-                if (SO_UINT32 == type) {
-                    PB_READ_UINT32(pb, n->int_val);
-                } else {
-                    PB_READ_UINT64(pb, n->int_val);
-                }
-
-                PB_READ_UINT32(pb, constr);
-                if (SC_MINSIZE == constr) {
-                    n->type = ST_MINSIZE;
-                } else if (SC_MAXSIZE == constr) {
-                    n->type = ST_MAXSIZE;
-                } else if (SC_SRCAVAIL == constr) {
-                    n->type = ST_SRCAVAIL;
-                } else if (SC_SRCCMPLETE == constr) {
-                    n->type = ST_SRCCOMLETE;
-                } else if (SC_MINBITRATE == constr) {
-                    n->type = ST_MINBITRATE;
-                } else if (SC_MINLENGTH == constr) {
-                    n->type = ST_MINLENGTH;
-                } else {
-                    PB_CHECK(0);
-                }
-            }
+    struct search_node nodes[MAX_SEARCH_NODES];
 
-        }
+    PB_CHECK(read_search_tree(pb, nodes, MAX_SEARCH_NODES));
+    client_search_files(clnt, &nodes[0]);
 
-        n = n->parent;
-    }
-
-    client_search_files(clnt, &root);
     return 1;
 
     malformed:
@@ -365,11 +557,7 @@ static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct clien
             if (clnt->id)
                 client_delete(clnt);
 
-            send_server_message(clnt->bev, g_srv.cfg->welcome_msg, g_srv.cfg->welcome_msg_len);
-            if (!g_srv.cfg->allow_lowid) {
-                static const char msg_highid[] = "WARNING: Only HighID clients!";
-                send_server_message(clnt->bev, msg_highid, sizeof(msg_highid) - 1);
-            }
+            send_welcome(clnt->bev);
             PB_CHECK(process_login_request(pb, clnt));
             return 1;
 
@@ -428,58 +616,99 @@ static int process_packet(struct packet_buffer *pb, uint8_t opcode, struct clien
     return 0;
 }
 
-static void server_read(struct client *clnt)
+/**
+@brief processes packet routed to i/o thread, nothing here may touch database
+@return zero if packet must be processed by worker
+*/
+static int process_packet_inline(struct packet_buffer *pb, uint8_t opcode, struct client *clnt)
+{
+    switch (opcode) {
+        case OP_GETSOURCES:
+            // cache misses and malformed packets are left to worker
+            return (PB_LEFT(pb) == ED2K_HASH_SIZE) && client_get_sources_cached(clnt, pb->ptr);
+
+        default:
+            return process_packet(pb, opcode, clnt);
+    }
+}
+
+/**
+@param clnt
+@param inline_only stop on first packet which is not routed to i/o thread
+@return zero if stopped on packet which must be processed by worker
+*/
+static int server_read(struct client *clnt, int inline_only)
 {
     struct evbuffer *input = bufferevent_get_input(clnt->bev);
     size_t src_len = evbuffer_get_length(input);
 
     while (!clnt->deleted && src_len > sizeof(struct packet_header)) {
-        unsigned char *data;
+        const unsigned char *data;
         struct packet_buffer pb;
         size_t packet_len;
-        int ret;
         const struct packet_header *header =
-                (struct packet_header *) evbuffer_pullup(input, sizeof(struct packet_header));
+                (const struct packet_header *) server_peek(input, sizeof(struct packet_header));
+
+        if (!header)
+            return 1;
 
         if ((PROTO_PACKED != header->proto) && (PROTO_EDONKEY != header->proto)) {
+            // removing client may wait for database
+            if (inline_only)
+                return 0;
             ED2KD_LOGDBG("unknown packet protocol from %s:%u", clnt->dbg.ip_str, clnt->port);
             client_delete(clnt);
-            return;
+            return 1;
         }
 
         // wait for full length packet
         packet_len = header->length + sizeof(struct packet_header);
         if (packet_len > src_len)
-            return;
+            return 1;
 
-        data = evbuffer_pullup(input, packet_len);
-        header = (struct packet_header *) data;
+        data = server_peek(input, packet_len);
+        if (!data)
+            return 1;
+        header = (const struct packet_header *) data;
         data += sizeof(struct packet_header);
 
+        // opcode is never compressed, unchecked client is removed on any packet
+        if (inline_only && ((ROUTE_INLINE != g_srv.cfg->opcode_route[*data]) || !clnt->portcheck_finished))
+            return 0;
+
         if (PROTO_PACKED == header->proto) {
-            unsigned long unpacked_len = MAX_UNCOMPRESSED_PACKET_SIZE;
-            unsigned char *unpacked = (unsigned char *) malloc(unpacked_len);
-
-            ret = uncompress(unpacked, &unpacked_len, data + 1, header->length - 1);
-            if (Z_OK == ret) {
-                PB_INIT(&pb, unpacked, unpacked_len);
-                ret = process_packet(&pb, *data, clnt);
-            } else {
+            size_t unpacked_len;
+            const unsigned char *unpacked = packet_inflate(data + 1, header->length - 1, &unpacked_len);
+
+            if (!unpacked) {
                 ED2KD_LOGDBG("failed to unpack packet from %s:%u", clnt->dbg.ip_str, clnt->port);
-                ret = 0;
+                return 1;
             }
-            free(unpacked);
+            PB_INIT(&pb, unpacked, unpacked_len);
         } else {
             PB_INIT(&pb, data + 1, header->length - 1);
-            ret = process_packet(&pb, *data, clnt);
         }
 
-        if (!ret)
-            return;
+        if (inline_only) {
+            if (!process_packet_inline(&pb, *data, clnt))
+                return 0;
+        } else if (!process_packet(&pb, *data, clnt)) {
+            return 1;
+        }
 
         evbuffer_drain(input, packet_len);
         src_len = evbuffer_get_length(input);
     }
+
+    return 1;
+}
+
+int server_read_inline(struct client *clnt)
+{
+    if (atomic_load(&clnt->deleted))
+        return 1;
+
+    return server_read(clnt, 1) || atomic_load(&clnt->deleted);
 }
 
 static void server_event(struct client *clnt, short events)
@@ -490,9 +719,49 @@ static void server_event(struct client *clnt, short events)
     }
 }
 
+static void server_process_job(struct job *job)
+{
+    switch (job->type) {
+
+        case JOB_SERVER_EVENT: {
+            struct job_event *j = (struct job_event *) job;
+            //ED2KD_LOGDBG("JOB_SERVER_EVENT event");
+            server_event(j->hdr.clnt, j->events);
+            break;
+        }
+
+        case JOB_SERVER_READ:
+            //ED2KD_LOGDBG("JOB_SERVER_READ event");
+            job_clear_pending(job);
+            server_read(job->clnt, 0);
+            break;
+
+        case JOB_PORTCHECK_EVENT: {
+            struct job_event *j = (struct job_event *) job;
+            //ED2KD_LOGDBG("JOB_PORTCHECK_EVENT event");
+            portcheck_event(job->clnt, j->events);
+            break;
+        }
+
+        case JOB_PORTCHECK_READ:
+            //ED2KD_LOGDBG("JOB_PORTCHECK_READ event");
+            job_clear_pending(job);
+            portcheck_read(job->clnt);
+            break;
+
+        case JOB_PORTCHECK_TIMEOUT:
+            portcheck_timeout(job->clnt);
+            break;
+
+        default:
+            assert(0);
+            break;
+    }
+}
+
 void *server_job_worker(void *ctx)
 {
-    (void) ctx;
+    struct job_worker *worker = (struct job_worker *) ctx;
 
     if (!db_open()) {
         ED2KD_LOGERR("failed to open database");
@@ -500,92 +769,119 @@ void *server_job_worker(void *ctx)
     }
 
     for (; ;) {
-        struct job *job = 0;
+        struct client *clnt;
+        size_t i;
 
-        pthread_mutex_lock(&g_srv.job_mutex);
-        for (; ;) {
-            struct job *j, *jtmp;
+        clnt = worker_pop(worker);
+        if (!clnt)
+            clnt = worker_steal(worker);
+        if (!clnt)
+            clnt = worker_wait(worker);
 
-            if (atomic_load(&g_srv.terminate)) {
-                pthread_mutex_unlock(&g_srv.job_mutex);
-                goto exit;
-            }
+        if (atomic_load(&g_srv.terminate))
+            goto exit;
 
-            TAILQ_FOREACH_SAFE(j, &g_srv.jqueue, qentry, jtmp) {
-                uint32_t old_val = 0;
-                if (atomic_compare_exchange_strong(&j->clnt->locked, &old_val, 1)) {
-                    TAILQ_REMOVE(&g_srv.jqueue, j, qentry);
-                    job = j;
-                    break;
-                }
-            }
+        if (!clnt)
+            continue;
+
+        // client is owned by this worker until it is released or requeued,
+        // so its jobs are processed strictly in order and all their
+        // responses are flushed to client at once
+        packet_cork(clnt->bev);
 
+        for (i = 0; i < MAX_JOBS_PER_DISPATCH; ++i) {
+            struct job *job;
+
+            pthread_mutex_lock(&clnt->job_mutex);
+            job = TAILQ_FIRST(&clnt->jqueue);
             if (job)
+                TAILQ_REMOVE(&clnt->jqueue, job, qentry);
+            pthread_mutex_unlock(&clnt->job_mutex);
+
+            if (!job)
                 break;
 
-            pthread_cond_wait(&g_srv.job_cond, &g_srv.job_mutex);
-        }
+            if (!atomic_load(&clnt->deleted))
+                server_process_job(job);
 
-        pthread_mutex_unlock(&g_srv.job_mutex);
-
-        if (!atomic_load(&job->clnt->deleted)) {
-            switch (job->type) {
-
-                case JOB_SERVER_EVENT: {
-                    struct job_event *j = (struct job_event *) job;
-                    //ED2KD_LOGDBG("JOB_SERVER_EVENT event");
-                    server_event(j->hdr.clnt, j->events);
-                    break;
-                }
-
-                case JOB_SERVER_READ:
-                    //ED2KD_LOGDBG("JOB_SERVER_READ event");
-                    server_read(job->clnt);
-                    break;
-
-                case JOB_SERVER_STATUS_NOTIFY:
-                    //ED2KD_LOGDBG("JOB_SERVER_STATUS_NOTIFY event");
-                    send_server_status(job->clnt->bev);
-                    event_add(job->clnt->evtimer_status_notify, g_srv.status_notify_tv);
-                    break;
-
-                case JOB_PORTCHECK_EVENT: {
-                    struct job_event *j = (struct job_event *) job;
-                    //ED2KD_LOGDBG("JOB_PORTCHECK_EVENT event");
-                    portcheck_event(job->clnt, j->events);
-                    break;
-                }
-
-                case JOB_PORTCHECK_READ:
-                    //ED2KD_LOGDBG("JOB_PORTCHECK_READ event");
-                    portcheck_read(job->clnt);
-                    break;
-
-                case JOB_PORTCHECK_TIMEOUT:
-                    portcheck_timeout(job->clnt);
-                    break;
-
-                default:
-                    assert(0);
-                    break;
-            }
+            client_decref(clnt);
+            job_free(job);
         }
 
-        atomic_store(&job->clnt->locked, 0);
-        client_decref(job->clnt);
-        free(job);
+        packet_uncork();
+        server_client_release(clnt);
     }
 
     exit:
     if (!db_close())
         ED2KD_LOGERR("failed to close database");
 
+    server_peek_free();
+    packet_inflate_free();
+    packet_deflate_free();
+    packet_cork_free();
+
     return NULL;
 }
 
+void server_log_stats(void)
+{
+    struct job_stats jstats;
+    struct db_stats dstats;
+    struct search_cache_stats sstats;
+    struct source_cache_stats cstats;
+    static struct timeval last_tv;
+    static uint64_t last_bytes;
+    struct timeval now_tv;
+    uint64_t linearized_bytes;
+    double elapsed;
+
+    ED2KD_LOGNFO("stats: %llu users, %llu files", (unsigned long long) counter_get(&g_srv.user_count),
+            (unsigned long long) counter_get(&g_srv.file_count));
+
+    job_get_stats(&jstats);
+    ED2KD_LOGNFO("stats: job pool %llu hits, %llu misses, %llu jobs coalesced",
+            (unsigned long long) jstats.pool_hits, (unsigned long long) jstats.pool_misses,
+            (unsigned long long) jstats.coalesced);
+
+    db_get_stats(&dstats);
+    ED2KD_LOGNFO("stats: search statements %llu hits, %llu misses",
+            (unsigned long long) dstats.search_stmt_hits, (unsigned long long) dstats.search_stmt_misses);
+
+    search_cache_get_stats(&sstats);
+    ED2KD_LOGNFO("stats: search cache %llu hits, %llu misses, %llu evictions",
+            (unsigned long long) sstats.hits, (unsigned long long) sstats.misses,
+            (unsigned long long) sstats.evictions);
+
+    source_cache_get_stats(&cstats);
+    ED2KD_LOGNFO("stats: source cache %llu hits, %llu misses, %llu evictions, %llu invalidations",
+            (unsigned long long) cstats.hits, (unsigned long long) cstats.misses,
+            (unsigned long long) cstats.evictions, (unsigned long long) cstats.invalidations);
+
+    // rate since previous stats output
+    evutil_gettimeofday(&now_tv, NULL);
+    if (!last_tv.tv_sec)
+        last_tv = g_srv.start_tv;
+    linearized_bytes = atomic_load_explicit(&g_srv.linearized_bytes, memory_order_relaxed);
+    elapsed = (now_tv.tv_sec - last_tv.tv_sec) + (now_tv.tv_usec - last_tv.tv_usec) / 1000000.0;
+    ED2KD_LOGNFO("stats: %llu status packets sent",
+            (unsigned long long) atomic_load_explicit(&g_srv.status_packets, memory_order_relaxed));
+
+    ED2KD_LOGNFO("stats: %llu packets linearized, %llu bytes, %.0f bytes/s",
+            (unsigned long long) atomic_load_explicit(&g_srv.linearized_packets, memory_order_relaxed),
+            (unsigned long long) linearized_bytes,
+            elapsed > 0 ? (linearized_bytes - last_bytes) / elapsed : 0.0);
+    last_tv = now_tv;
+    last_bytes = linearized_bytes;
+}
+
 void server_stop(void)
 {
+    size_t i;
+
     event_base_loopbreak(g_srv.evbase_main);
-    event_base_loopbreak(g_srv.evbase_tcp);
+    for (i = 0; i < g_srv.loop_count; ++i) {
+        event_base_loopbreak(g_srv.loops[i].evbase);
+    }
     atomic_store(&g_srv.terminate, 1);
 }
@@ -10,6 +10,8 @@
 #include <sys/time.h>
 #include "job.h"
 #include "atomic.h"
+#include "counter.h"
+#include "db.h"
 
 struct event_base;
 struct evconnlistener;
@@ -22,6 +24,14 @@ struct client;
 #define MAX_SEARCH_FILES                200
 #define MAX_UNCOMPRESSED_PACKET_SIZE    300*1024
 
+/* where incoming packet with given opcode is processed */
+enum packet_route {
+    /* job worker thread */
+    ROUTE_WORKER = 0,
+    /* i/o thread, right in read callback */
+    ROUTE_INLINE
+};
+
 struct server_config {
     /* listen ip address */
     char *listen_addr;
@@ -59,9 +69,18 @@ struct server_config {
     /* port check timeout */
     struct timeval portcheck_timeout_tv;
 
-    /* server status sending interval */
+    /* server status sending interval, minimal one in change-driven mode */
     struct timeval status_notify_tv;
 
+    /* maximal status interval in milliseconds (0 - fixed interval mode) */
+    unsigned status_notify_max_interval;
+
+    /* relative change of user or file count (percents) which triggers status before maximal interval */
+    unsigned status_change_threshold;
+
+    /* random part of maximal status interval (percents) */
+    unsigned status_notify_jitter;
+
     /* maximum connected clients */
     size_t max_clients;
 
@@ -77,41 +96,129 @@ struct server_config {
     /* maximum searches limit */
     size_t max_searches_limit;
 
+    /* search result cache entries (0 - disabled) */
+    size_t search_cache_size;
+
+    /* search result cache entry life time in seconds (0 - until database changes) */
+    unsigned search_cache_ttl;
+
+    /* minimal size of compressed outgoing packets (0 - no compression) */
+    size_t compress_threshold;
+
+    /* found sources cache entries (0 - disabled) */
+    size_t source_cache_size;
+
+    /* order of found sources */
+    enum source_selection source_selection;
+
+    /* job worker threads count (0 - number of cpus + 1) */
+    size_t worker_threads;
+
+    /* network i/o threads count */
+    size_t io_threads;
+
+    /* per-opcode packet routing */
+    unsigned char opcode_route[256];
+
     /* allow lowid clients flag */
     unsigned allow_lowid:1;
+
+    /* some opcodes are processed on i/o thread (run-to-completion) */
+    unsigned inline_packets:1;
 };
 
-struct server_instance {
-    /* general event base */
-    struct event_base *evbase_tcp;
-    /* login event base */
-    struct event_base *evbase_main;
+struct job_worker {
+    /* worker thread */
+    pthread_t thread;
+    /* worker index in server instance */
+    size_t idx;
+    /* run queue mutex */
+    pthread_mutex_t job_mutex;
+    /* run queue access condition */
+    pthread_cond_t job_cond;
+    /* queue of clients with pending jobs, owner pops from head, thieves from tail */
+    struct client_queue runq;
+    /* worker is waiting on job_cond */
+    atomic_uint32_t idle;
+    /* wake up request from other thread (guarded by job_mutex) */
+    int kicked;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* slots of per-loop status wheel, every client is notified once per full turn */
+#define STATUS_WHEEL_SLOTS  64
+
+struct status_slot {
+    /* clients notified at this slot */
+    struct client_queue clients;
+    /* user count sent last time */
+    uint32_t user_count;
+    /* file count sent last time */
+    uint32_t file_count;
+    /* time of forced status in change-driven mode (milliseconds) */
+    uint64_t due_ms;
+};
+
+struct io_loop {
+    /* loop thread */
+    pthread_t thread;
+    /* loop index in server instance */
+    size_t idx;
+    /* event base for listener and all client connections accepted by it */
+    struct event_base *evbase;
     /* tcp connection listener */
     struct evconnlistener *tcp_listener;
+    /* common timeval for port check timeout */
+    const struct timeval *portcheck_timeout_tv;
+    /* guards status wheel */
+    pthread_mutex_t status_mutex;
+    /* logged in clients, spread over slots by login time */
+    struct status_slot status_wheel[STATUS_WHEEL_SLOTS];
+    /* slot notified by next tick */
+    size_t status_slot;
+    /* fires STATUS_WHEEL_SLOTS times per status notify interval */
+    struct event *ev_status_tick;
+};
+
+struct server_instance {
+    /* main event base (signals) */
+    struct event_base *evbase_main;
+    /* network i/o loops */
+    struct io_loop *loops;
+    /* network i/o loops count */
+    size_t loop_count;
     /* server configuration loaded from file */
     const struct server_config *cfg;
     /* working threads count */
     size_t thread_count;
+    /* job workers */
+    struct job_worker *workers;
+    /* server start time */
+    struct timeval start_tv;
+
+    /* frequently written atomics below live on separate cache lines */
+
+    /* number of idle job workers */
+    atomic_uint32_t idle_workers __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* next worker for new client */
+    atomic_uint32_t next_worker __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* next block of lowids, threads take LOWID_BLOCK ids at once */
+    atomic_uint32_t lowid_counter __attribute__((aligned(CACHE_LINE_SIZE)));
+
     /* connected users count */
-    atomic_uint32_t user_count;
+    struct sharded_counter user_count;
     /* shared files count */
-    atomic_uint32_t file_count;
-    /* lowid counter */
-    atomic_uint32_t lowid_counter;
+    struct sharded_counter file_count;
 
-    /* termination flag */
-    atomic_uint32_t terminate;
-    /* job queue mutex */
-    pthread_mutex_t job_mutex;
-    /* job access condition */
-    pthread_cond_t job_cond;
-    /* job queue */
-    struct job_queue jqueue;
+    /* server status packets sent */
+    atomic_uint64_t status_packets __attribute__((aligned(CACHE_LINE_SIZE)));
 
-    /* common timeval for port check timeout */
-    const struct timeval *portcheck_timeout_tv;
-    /* common server status notify interval */
-    const struct timeval *status_notify_tv;
+    /* packets copied because they span several input buffer chunks */
+    atomic_uint64_t linearized_packets __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* bytes of such packets */
+    atomic_uint64_t linearized_bytes;
+
+    /* termination flag, read by all threads */
+    atomic_uint32_t terminate __attribute__((aligned(CACHE_LINE_SIZE)));
 };
 
 extern struct server_instance g_srv;
@@ -129,16 +236,43 @@ int server_load_config(const char *path);
 void server_free_config(void);
 
 /**
-@brief start main loop and accept incoming connections
+@brief creates network i/o loops
+@param count loops count
+@return non-zero on success
+*/
+int server_init_loops(size_t count);
+
+/**
+@brief frees network i/o loops and their listeners
+*/
+void server_free_loops(void);
+
+/**
+@brief starts listeners on all i/o loops and runs main loop
 @return non-zero on success
 */
 int server_listen(void);
 
+/**
+@brief enables accepting new connections on all loops
+*/
+void server_enable_listeners(void);
+
+/**
+@brief disables accepting new connections on all loops
+*/
+void server_disable_listeners(void);
+
 /**
 @brief breaks all running event loops
 */
 void server_stop(void);
 
+/**
+@brief logs server statistics
+*/
+void server_log_stats(void);
+
 /**
 @param arg
 @return
@@ -146,12 +280,63 @@ void server_stop(void);
 void *server_base_worker(void *arg);
 
 /**
-@param ctx
+@brief initializes job workers run queues
+@param count workers count
+@return non-zero on success
+*/
+int server_init_workers(size_t count);
+
+/**
+@brief wakes up all job workers, used on termination
+*/
+void server_wakeup_workers(void);
+
+/**
+@brief frees job workers run queues
+*/
+void server_free_workers(void);
+
+/**
+@param ctx pointer to struct job_worker
 @return
 */
 void *server_job_worker(void *ctx);
 
 /**
+@brief takes client for exclusive processing if it has no scheduled jobs
+@param clnt
+@return non-zero on success
+*/
+int server_client_acquire(struct client *clnt);
+
+/**
+@brief releases client taken by server_client_acquire() or from run queue,
+ client is scheduled again if its mailbox is not empty
+@param clnt
+*/
+void server_client_release(struct client *clnt);
+
+/**
+@brief processes packets routed to i/o thread, client must be acquired
+@param clnt
+@return zero if some packets left for job worker
+*/
+int server_read_inline(struct client *clnt);
+
+/**
+@brief starts periodic status notifications of client, called once after login
+@param clnt
+*/
+void server_status_add(struct client *clnt);
+
+/**
+@brief stops status notifications of client, called before its bufferevent is freed
+@param clnt
+*/
+void server_status_remove(struct client *clnt);
+
+/**
+@brief puts job into client's mailbox and schedules client if it is idle
 @param job
 */
 void server_add_job(struct job *job);
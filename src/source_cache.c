@@ -0,0 +1,244 @@
+#include "source_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include "uthash/uthash.h"
+#include "queue.h"
+#include "atomic.h"
+#include "ed2k_proto.h"
+
+/*
+  Encoded OP_FOUNDSOURCES packets keyed by file hash. Table is split into
+  shards by first hash byte, every shard has own lock, lru list and
+  generation. Generation is bumped on every invalidation of any file in
+  shard, so packet built from database state read before invalidation
+  is never stored. Entries are reference counted like search cache ones.
+*/
+
+#define SOURCE_SHARD_COUNT  256
+
+struct source_cache_entry {
+    /* references from table and buffers */
+    atomic_uint32_t ref_cnt;
+    /* file hash */
+    unsigned char hash[ED2K_HASH_SIZE];
+    /* lru list entry */
+    TAILQ_ENTRY(source_cache_entry) qentry;
+    /* makes this structure hashable */
+    UT_hash_handle hh;
+    /* packet length */
+    size_t len;
+    /* packet */
+    unsigned char data[];
+};
+
+TAILQ_HEAD(source_cache_lru, source_cache_entry);
+
+struct source_shard {
+    /* guards table, lru list and generation */
+    pthread_mutex_t mutex;
+    /* entries table */
+    struct source_cache_entry *entries;
+    /* most recently used first */
+    struct source_cache_lru lru;
+    /* entries count */
+    size_t count;
+    /* changed on every invalidation */
+    uint32_t generation;
+} __attribute__((aligned(64)));
+
+static struct source_shard s_shards[SOURCE_SHARD_COUNT];
+static size_t s_shard_capacity;
+static atomic_uint64_t s_hits;
+static atomic_uint64_t s_misses;
+static atomic_uint64_t s_evictions;
+static atomic_uint64_t s_invalidations;
+
+static void entry_unref(struct source_cache_entry *entry)
+{
+    if (1 == atomic_fetch_sub(&entry->ref_cnt, 1))
+        free(entry);
+}
+
+static void entry_unref_cb(const void *data, size_t len, void *arg)
+{
+    (void) data;
+    (void) len;
+    entry_unref((struct source_cache_entry *) arg);
+}
+
+/* must be called with shard mutex held */
+static void entry_remove(struct source_shard *shard, struct source_cache_entry *entry)
+{
+    HASH_DEL(shard->entries, entry);
+    TAILQ_REMOVE(&shard->lru, entry, qentry);
+    shard->count--;
+    entry_unref(entry);
+}
+
+int source_cache_init(size_t capacity)
+{
+    size_t i;
+
+    s_shard_capacity = capacity ? (capacity + SOURCE_SHARD_COUNT - 1) / SOURCE_SHARD_COUNT : 0;
+
+    for (i = 0; i < SOURCE_SHARD_COUNT; ++i) {
+        struct source_shard *shard = &s_shards[i];
+
+        if (pthread_mutex_init(&shard->mutex, NULL))
+            return 0;
+        shard->entries = NULL;
+        TAILQ_INIT(&shard->lru);
+        shard->count = 0;
+        shard->generation = 0;
+    }
+
+    return 1;
+}
+
+void source_cache_destroy(void)
+{
+    size_t i;
+
+    for (i = 0; i < SOURCE_SHARD_COUNT; ++i) {
+        struct source_shard *shard = &s_shards[i];
+
+        while (!TAILQ_EMPTY(&shard->lru)) {
+            entry_remove(shard, TAILQ_FIRST(&shard->lru));
+        }
+        pthread_mutex_destroy(&shard->mutex);
+    }
+}
+
+uint32_t source_cache_generation(const unsigned char *hash)
+{
+    struct source_shard *shard = &s_shards[hash[0]];
+    uint32_t generation;
+
+    if (!s_shard_capacity)
+        return 0;
+
+    pthread_mutex_lock(&shard->mutex);
+    generation = shard->generation;
+    pthread_mutex_unlock(&shard->mutex);
+
+    return generation;
+}
+
+int source_cache_get(const unsigned char *hash, struct evbuffer *out)
+{
+    struct source_shard *shard = &s_shards[hash[0]];
+    struct source_cache_entry *entry;
+
+    if (!s_shard_capacity)
+        return 0;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    HASH_FIND(hh, shard->entries, hash, ED2K_HASH_SIZE, entry);
+    if (entry) {
+        TAILQ_REMOVE(&shard->lru, entry, qentry);
+        TAILQ_INSERT_HEAD(&shard->lru, entry, qentry);
+        atomic_fetch_add(&entry->ref_cnt, 1);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!entry) {
+        atomic_fetch_add_explicit(&s_misses, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    if (evbuffer_add_reference(out, entry->data, entry->len, entry_unref_cb, entry) < 0) {
+        entry_unref(entry);
+        atomic_fetch_add_explicit(&s_misses, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&s_hits, 1, memory_order_relaxed);
+    return 1;
+}
+
+void source_cache_put(const unsigned char *hash, uint32_t generation, const struct file_source *sources, size_t count)
+{
+    struct source_shard *shard = &s_shards[hash[0]];
+    struct source_cache_entry *entry, *old;
+    struct packet_found_sources *data;
+    size_t srcs_len = count * sizeof(*sources);
+
+    // any hash may be requested, empty results would evict entries of existing files
+    if (!s_shard_capacity || !count)
+        return;
+
+    entry = (struct source_cache_entry *) malloc(sizeof(*entry) + sizeof(*data) + srcs_len);
+    if (!entry)
+        return;
+
+    atomic_init(&entry->ref_cnt, 1);
+    memcpy(entry->hash, hash, sizeof(entry->hash));
+    entry->len = sizeof(*data) + srcs_len;
+
+    data = (struct packet_found_sources *) entry->data;
+    data->hdr.proto = PROTO_EDONKEY;
+    data->hdr.length = sizeof(*data) - sizeof(data->hdr) + srcs_len;
+    data->opcode = OP_FOUNDSOURCES;
+    memcpy(data->hash, hash, sizeof(data->hash));
+    data->count = count;
+    memcpy(entry->data + sizeof(*data), sources, srcs_len);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // source set was changed during query
+    if (generation != shard->generation) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(entry);
+        return;
+    }
+
+    // concurrent query of the same file may be already stored
+    HASH_FIND(hh, shard->entries, hash, ED2K_HASH_SIZE, old);
+    if (old)
+        entry_remove(shard, old);
+
+    while (shard->count >= s_shard_capacity) {
+        entry_remove(shard, TAILQ_LAST(&shard->lru, source_cache_lru));
+        atomic_fetch_add_explicit(&s_evictions, 1, memory_order_relaxed);
+    }
+
+    HASH_ADD(hh, shard->entries, hash, ED2K_HASH_SIZE, entry);
+    TAILQ_INSERT_HEAD(&shard->lru, entry, qentry);
+    shard->count++;
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void source_cache_invalidate(const unsigned char *hash)
+{
+    struct source_shard *shard = &s_shards[hash[0]];
+    struct source_cache_entry *entry;
+
+    if (!s_shard_capacity)
+        return;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    shard->generation++;
+    HASH_FIND(hh, shard->entries, hash, ED2K_HASH_SIZE, entry);
+    if (entry) {
+        entry_remove(shard, entry);
+        atomic_fetch_add_explicit(&s_invalidations, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void source_cache_get_stats(struct source_cache_stats *stats)
+{
+    stats->hits = atomic_load_explicit(&s_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&s_misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&s_evictions, memory_order_relaxed);
+    stats->invalidations = atomic_load_explicit(&s_invalidations, memory_order_relaxed);
+}
@@ -0,0 +1,71 @@
+#ifndef ED2KD_SOURCE_CACHE_H
+#define ED2KD_SOURCE_CACHE_H
+
+/*
+@file source_cache.h Cache of encoded OP_FOUNDSOURCES packets
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct evbuffer;
+struct file_source;
+
+struct source_cache_stats {
+    /* requests answered from cache */
+    uint64_t hits;
+    /* requests which required database query */
+    uint64_t misses;
+    /* entries dropped because of capacity limit */
+    uint64_t evictions;
+    /* entries dropped because source set was changed */
+    uint64_t invalidations;
+};
+
+/**
+@brief initializes cache
+@param capacity  maximum entries count, 0 disables cache
+@return non-zero on success
+*/
+int source_cache_init(size_t capacity);
+
+/**
+@brief frees all entries, entries still referenced by buffers are freed with them
+*/
+void source_cache_destroy(void);
+
+/**
+@brief source set generation of file, must be taken before database query
+@param hash  file hash
+*/
+uint32_t source_cache_generation(const unsigned char *hash);
+
+/**
+@brief appends cached OP_FOUNDSOURCES packet to buffer by reference
+@param hash  file hash
+@return non-zero if cached packet was found
+*/
+int source_cache_get(const unsigned char *hash, struct evbuffer *out);
+
+/**
+@brief encodes and stores OP_FOUNDSOURCES packet, empty result is not stored
+@param hash        file hash
+@param generation  source set generation taken before database query
+@param sources     found sources
+@param count       sources count
+*/
+void source_cache_put(const unsigned char *hash, uint32_t generation, const struct file_source *sources, size_t count);
+
+/**
+@brief drops cached packet, called when source set of file changes
+@param hash  file hash
+*/
+void source_cache_invalidate(const unsigned char *hash);
+
+/**
+@brief collects cache statistics
+@param stats
+*/
+void source_cache_get_stats(struct source_cache_stats *stats);
+
+#endif // ED2KD_SOURCE_CACHE_H
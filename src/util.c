@@ -55,26 +55,59 @@ void get_random_user_hash(unsigned char *hash)
     hash[15] = 111;
 }
 
+uint32_t get_random_uint32(void)
+{
+    static THREAD_LOCAL uint32_t state;
+
+    // xorshift32, seeded once per thread
+    while (!state)
+        evutil_secure_rng_get_bytes((char *) &state, sizeof(state));
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+#define TYPE_IS(type, str) \
+        (memcmp((type), (str), sizeof(str) - 1) == 0)
+
 uint8_t get_ed2k_file_type(const char *type, size_t len)
 {
-    if (strncmp(FTS_AUDIO, type, len) == 0) {
-        return FT_AUDIO;
-    } else if (strncmp(FTS_VIDEO, type, len) == 0) {
-        return FT_VIDEO;
-    } else if (strncmp(FTS_IMAGE, type, len) == 0) {
-        return FT_IMAGE;
-    } else if (strncmp(FTS_DOCUMENT, type, len) == 0) {
-        return FT_DOCUMENT;
-    } else if (strncmp(FTS_PROGRAM, type, len) == 0) {
-        return FT_PROGRAM;
-    } else if (strncmp(FTS_ARCHIVE, type, len) == 0) {
-        return FT_ARCHIVE;
-    } else if (strncmp(FTS_CDIMAGE, type, len) == 0) {
-        return FT_CDIMAGE;
-    } else if (strncmp(FTS_EMULECOLLECTION, type, len) == 0) {
-        return FT_EMULECOLLECTION;
-    } else {
-        return FT_ANY;
+    // type strings are dispatched by length and first letter
+    switch (len) {
+        case sizeof(FTS_DOCUMENT) - 1:
+            switch (type[0]) {
+                case 'D':
+                    return TYPE_IS(type, FTS_DOCUMENT) ? FT_DOCUMENT : FT_ANY;
+                case 'P':
+                    return TYPE_IS(type, FTS_PROGRAM) ? FT_PROGRAM : FT_ANY;
+                case 'A':
+                    return TYPE_IS(type, FTS_ARCHIVE) ? FT_ARCHIVE : FT_ANY;
+                case 'I':
+                    return TYPE_IS(type, FTS_CDIMAGE) ? FT_CDIMAGE : FT_ANY;
+                default:
+                    return FT_ANY;
+            }
+
+        case sizeof(FTS_AUDIO) - 1:
+            switch (type[0]) {
+                case 'A':
+                    return TYPE_IS(type, FTS_AUDIO) ? FT_AUDIO : FT_ANY;
+                case 'V':
+                    return TYPE_IS(type, FTS_VIDEO) ? FT_VIDEO : FT_ANY;
+                case 'I':
+                    return TYPE_IS(type, FTS_IMAGE) ? FT_IMAGE : FT_ANY;
+                default:
+                    return FT_ANY;
+            }
+
+        case sizeof(FTS_EMULECOLLECTION) - 1:
+            return TYPE_IS(type, FTS_EMULECOLLECTION) ? FT_EMULECOLLECTION : FT_ANY;
+
+        default:
+            return FT_ANY;
     }
 }
 
@@ -98,6 +131,34 @@ const char *file_extension(const char *name, size_t len)
     return ext;
 }
 
+static int is_word_char(unsigned char c)
+{
+    // non-ascii (utf-8) bytes are always part of word
+    return (c >= 0x80) || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+const char *next_word(const char *str, size_t len, size_t *pos, size_t *word_len)
+{
+    size_t i = *pos, begin;
+
+    while ((i < len) && !is_word_char(str[i]))
+        i++;
+
+    if (i == len) {
+        *pos = len;
+        return NULL;
+    }
+
+    begin = i;
+    while ((i < len) && is_word_char(str[i]))
+        i++;
+
+    *pos = i;
+    *word_len = i - begin;
+
+    return str + begin;
+}
+
 int token_bucket_update(struct token_bucket *bucket, double max_tokens)
 {
     time_t now = time(NULL);
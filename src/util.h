@@ -45,6 +45,11 @@ int bin2hex(const unsigned char *src, char *dst, size_t dst_len);
 */
 void get_random_user_hash(unsigned char *hash);
 
+/**
+@brief fast non-cryptographic random number, state is thread local
+*/
+uint32_t get_random_uint32(void);
+
 /**
 @brief get integer ed2k file type from string file type
 @param type   string type
@@ -60,6 +65,16 @@ uint8_t get_ed2k_file_type(const char *type, size_t len);
 */
 const char *file_extension(const char *name, size_t len);
 
+/**
+@brief finds next word in string, words are separated by ascii spaces and punctuation
+@param str       source string
+@param len       source string length
+@param pos       in: offset to start from, out: offset right after found word
+@param word_len  found word length
+@return pointer where word begins or NULL if no more words
+*/
+const char *next_word(const char *str, size_t len, size_t *pos, size_t *word_len);
+
 struct token_bucket {
     double tokens;
     time_t last_update;
@@ -0,0 +1,380 @@
+#include "word_index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "uthash/uthash.h"
+#include "util.h"
+#include "log.h"
+
+/*
+  Word -> sorted list of file ids. Words table is split into shards by
+  word hash, every shard is guarded by its own rwlock. Words are lowercased
+  (ascii only) and truncated to MAX_WORD_LEN bytes.
+*/
+
+#define WORD_SHARD_COUNT        256
+#define MAX_WORD_LEN            64
+#define MIN_POSTING_CAPACITY    4
+
+struct word_entry {
+    /* sorted file ids */
+    uint32_t *fids;
+    /* file ids count */
+    uint32_t count;
+    /* fids array capacity */
+    uint32_t capacity;
+    /* makes this structure hashable */
+    UT_hash_handle hh;
+    /* key length */
+    uint8_t len;
+    /* key */
+    char word[];
+};
+
+struct word_shard {
+    /* guards words table and postings */
+    pthread_rwlock_t lock;
+    /* words table */
+    struct word_entry *words;
+} __attribute__((aligned(64)));
+
+static struct word_shard s_shards[WORD_SHARD_COUNT];
+
+static size_t normalize_word(const char *word, size_t len, char *out)
+{
+    size_t i;
+
+    if (len > MAX_WORD_LEN)
+        len = MAX_WORD_LEN;
+
+    for (i = 0; i < len; ++i) {
+        char c = word[i];
+        out[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    return len;
+}
+
+static struct word_shard *get_shard(const char *word, size_t len)
+{
+    // fnv-1a
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char) word[i];
+        hash *= 16777619u;
+    }
+
+    return &s_shards[hash % WORD_SHARD_COUNT];
+}
+
+static size_t lower_bound(const uint32_t *ids, size_t count, uint32_t fid)
+{
+    size_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] < fid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int posting_insert(struct word_entry *we, uint32_t fid)
+{
+    size_t pos;
+
+    // new ids are mostly growing, so check tail first
+    if (!we->count || (we->fids[we->count - 1] < fid)) {
+        pos = we->count;
+    } else {
+        pos = lower_bound(we->fids, we->count, fid);
+        if (we->fids[pos] == fid)
+            return 1;
+    }
+
+    if (we->count == we->capacity) {
+        uint32_t capacity = we->capacity ? we->capacity * 2 : MIN_POSTING_CAPACITY;
+        uint32_t *fids = (uint32_t *) realloc(we->fids, capacity * sizeof(*fids));
+        if (!fids)
+            return 0;
+        we->fids = fids;
+        we->capacity = capacity;
+    }
+
+    memmove(we->fids + pos + 1, we->fids + pos, (we->count - pos) * sizeof(*we->fids));
+    we->fids[pos] = fid;
+    we->count++;
+
+    return 1;
+}
+
+int word_index_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < WORD_SHARD_COUNT; ++i) {
+        if (pthread_rwlock_init(&s_shards[i].lock, NULL)) {
+            ED2KD_LOGERR("failed to init word shard lock");
+            return 0;
+        }
+        s_shards[i].words = NULL;
+    }
+
+    return 1;
+}
+
+void word_index_destroy(void)
+{
+    size_t i;
+
+    for (i = 0; i < WORD_SHARD_COUNT; ++i) {
+        struct word_shard *shard = &s_shards[i];
+        struct word_entry *we, *tmp;
+
+        HASH_ITER(hh, shard->words, we, tmp) {
+            HASH_DEL(shard->words, we);
+            free(we->fids);
+            free(we);
+        }
+        pthread_rwlock_destroy(&shard->lock);
+    }
+}
+
+int word_index_add(const char *name, size_t len, uint32_t fid)
+{
+    const char *word;
+    size_t pos = 0, word_len;
+    int ret = 1;
+
+    while ((word = next_word(name, len, &pos, &word_len))) {
+        char key[MAX_WORD_LEN];
+        size_t key_len = normalize_word(word, word_len, key);
+        struct word_shard *shard = get_shard(key, key_len);
+        struct word_entry *we;
+
+        pthread_rwlock_wrlock(&shard->lock);
+
+        HASH_FIND(hh, shard->words, key, key_len, we);
+        if (!we) {
+            we = (struct word_entry *) calloc(1, sizeof(*we) + key_len);
+            if (we) {
+                we->len = key_len;
+                memcpy(we->word, key, key_len);
+                HASH_ADD_KEYPTR(hh, shard->words, we->word, we->len, we);
+            }
+        }
+
+        if (!we || !posting_insert(we, fid))
+            ret = 0;
+
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    return ret;
+}
+
+void word_index_remove(const char *name, size_t len, uint32_t fid)
+{
+    const char *word;
+    size_t pos = 0, word_len;
+
+    while ((word = next_word(name, len, &pos, &word_len))) {
+        char key[MAX_WORD_LEN];
+        size_t key_len = normalize_word(word, word_len, key);
+        struct word_shard *shard = get_shard(key, key_len);
+        struct word_entry *we;
+
+        pthread_rwlock_wrlock(&shard->lock);
+
+        HASH_FIND(hh, shard->words, key, key_len, we);
+        if (we) {
+            size_t i = lower_bound(we->fids, we->count, fid);
+
+            // same word may occur twice in name
+            if ((i < we->count) && (we->fids[i] == fid)) {
+                we->count--;
+                memmove(we->fids + i, we->fids + i + 1, (we->count - i) * sizeof(*we->fids));
+            }
+
+            if (!we->count) {
+                HASH_DEL(shard->words, we);
+                free(we->fids);
+                free(we);
+            }
+        }
+
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/**
+@brief intersects sorted lists, out may point to a
+@return resulting count
+*/
+static size_t intersect(const uint32_t *a, size_t na, const uint32_t *b, size_t nb, uint32_t *out)
+{
+    size_t i = 0, j = 0, k = 0;
+
+#ifdef __SSE2__
+    // compare 4x4 blocks, every element of a against all rotations of b
+    while ((i + 4 <= na) && (j + 4 <= nb)) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + j));
+        __m128i cmp = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                             _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+                _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                             _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+        uint32_t a_max = a[i + 3], b_max = b[j + 3];
+
+        while (mask) {
+            out[k++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+
+        if (a_max <= b_max)
+            i += 4;
+        if (b_max <= a_max)
+            j += 4;
+    }
+#endif
+
+    while ((i < na) && (j < nb)) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            out[k++] = a[i];
+            i++;
+            j++;
+        }
+    }
+
+    return k;
+}
+
+int word_index_find(const char *term, size_t len, struct fid_list *out)
+{
+    const char *word;
+    size_t pos = 0, word_len;
+    int first = 1;
+
+    out->ids = NULL;
+    out->count = 0;
+
+    while ((word = next_word(term, len, &pos, &word_len))) {
+        char key[MAX_WORD_LEN];
+        size_t key_len = normalize_word(word, word_len, key);
+        struct word_shard *shard = get_shard(key, key_len);
+        struct word_entry *we;
+        int ok = 1;
+
+        pthread_rwlock_rdlock(&shard->lock);
+
+        HASH_FIND(hh, shard->words, key, key_len, we);
+        if (!we) {
+            out->count = 0;
+        } else if (first) {
+            out->ids = (uint32_t *) malloc(we->count * sizeof(*out->ids));
+            if (out->ids) {
+                memcpy(out->ids, we->fids, we->count * sizeof(*out->ids));
+                out->count = we->count;
+            } else {
+                ok = 0;
+            }
+        } else {
+            out->count = intersect(out->ids, out->count, we->fids, we->count, out->ids);
+        }
+
+        pthread_rwlock_unlock(&shard->lock);
+
+        if (!ok)
+            return 0;
+        if (!out->count)
+            break;
+        first = 0;
+    }
+
+    return 1;
+}
+
+int fid_list_and(struct fid_list *a, const struct fid_list *b)
+{
+    a->count = intersect(a->ids, a->count, b->ids, b->count, a->ids);
+    return 1;
+}
+
+int fid_list_or(struct fid_list *a, const struct fid_list *b)
+{
+    size_t i = 0, j = 0, k = 0;
+    uint32_t *ids;
+
+    if (!b->count)
+        return 1;
+
+    ids = (uint32_t *) malloc((a->count + b->count) * sizeof(*ids));
+    if (!ids)
+        return 0;
+
+    while ((i < a->count) && (j < b->count)) {
+        if (a->ids[i] < b->ids[j]) {
+            ids[k++] = a->ids[i++];
+        } else if (b->ids[j] < a->ids[i]) {
+            ids[k++] = b->ids[j++];
+        } else {
+            ids[k++] = a->ids[i++];
+            j++;
+        }
+    }
+    while (i < a->count)
+        ids[k++] = a->ids[i++];
+    while (j < b->count)
+        ids[k++] = b->ids[j++];
+
+    free(a->ids);
+    a->ids = ids;
+    a->count = k;
+
+    return 1;
+}
+
+int fid_list_not(struct fid_list *a, const struct fid_list *b)
+{
+    size_t i = 0, j = 0, k = 0;
+
+    while ((i < a->count) && (j < b->count)) {
+        if (a->ids[i] < b->ids[j]) {
+            a->ids[k++] = a->ids[i++];
+        } else if (b->ids[j] < a->ids[i]) {
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    while (i < a->count)
+        a->ids[k++] = a->ids[i++];
+
+    a->count = k;
+
+    return 1;
+}
+
+void fid_list_free(struct fid_list *list)
+{
+    free(list->ids);
+    list->ids = NULL;
+    list->count = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef ED2KD_WORD_INDEX_H
+#define ED2KD_WORD_INDEX_H
+
+/*
+@file word_index.h Inverted index of file name words
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* sorted list of file ids */
+struct fid_list {
+    uint32_t *ids;
+    size_t count;
+};
+
+/**
+@return non-zero on success
+*/
+int word_index_init(void);
+
+void word_index_destroy(void);
+
+/**
+@brief adds all words of file name to index
+@return non-zero on success
+*/
+int word_index_add(const char *name, size_t len, uint32_t fid);
+
+/**
+@brief removes all words of file name from index
+*/
+void word_index_remove(const char *name, size_t len, uint32_t fid);
+
+/**
+@brief finds files which names contain all words of search term
+@param out  resulting list, must be freed with fid_list_free()
+@return non-zero on success
+*/
+int word_index_find(const char *term, size_t len, struct fid_list *out);
+
+/**
+@brief a = a AND b
+@return non-zero on success
+*/
+int fid_list_and(struct fid_list *a, const struct fid_list *b);
+
+/**
+@brief a = a OR b
+@return non-zero on success
+*/
+int fid_list_or(struct fid_list *a, const struct fid_list *b);
+
+/**
+@brief a = a AND NOT b
+@return non-zero on success
+*/
+int fid_list_not(struct fid_list *a, const struct fid_list *b);
+
+void fid_list_free(struct fid_list *list);
+
+#endif // ED2KD_WORD_INDEX_H
@@ -0,0 +1,190 @@
+/*
+@file bench_parse.c Microbenchmark of packet parsers
+
+Parses typical OP_OFFERFILES (200 files, old and new tags) and
+OP_SEARCHREQUEST payloads in a loop and prints time per packet.
+Usage: bench_parse [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "server.h"
+#include "packet.h"
+#include "ed2k_proto.h"
+
+/* packet.c refers to server instance */
+struct server_instance g_srv;
+
+#define BENCH_BUF_SIZE  (256 * 1024)
+
+static unsigned char *put(unsigned char *p, const void *data, size_t len)
+{
+    memcpy(p, data, len);
+    return p + len;
+}
+
+static unsigned char *put_uint8(unsigned char *p, uint8_t val)
+{
+    return put(p, &val, sizeof val);
+}
+
+static unsigned char *put_uint16(unsigned char *p, uint16_t val)
+{
+    return put(p, &val, sizeof val);
+}
+
+static unsigned char *put_uint32(unsigned char *p, uint32_t val)
+{
+    return put(p, &val, sizeof val);
+}
+
+static unsigned char *put_tag_name(unsigned char *p, uint8_t type, uint8_t name, int newtags)
+{
+    if (newtags)
+        return put_uint8(put_uint8(p, type | 0x80), name);
+
+    return put_uint8(put_uint16(put_uint8(p, type), 1), name);
+}
+
+static unsigned char *put_tag_str(unsigned char *p, uint8_t name, const char *str, int newtags)
+{
+    uint16_t len = strlen(str);
+
+    if (newtags && (len <= 16))
+        return put(put_tag_name(p, TT_STR1 + len - 1, name, newtags), str, len);
+
+    p = put_tag_name(p, TT_STRING, name, newtags);
+    return put(put_uint16(p, len), str, len);
+}
+
+static unsigned char *put_tag_uint32(unsigned char *p, uint8_t name, uint32_t val, int newtags)
+{
+    return put_uint32(put_tag_name(p, TT_UINT32, name, newtags), val);
+}
+
+static size_t make_offer(unsigned char *buf, int newtags)
+{
+    unsigned char *p = put_uint32(buf, MAX_OFFER_FILES);
+    uint32_t i;
+
+    for (i = 0; i < MAX_OFFER_FILES; ++i) {
+        unsigned char hash[ED2K_HASH_SIZE];
+        char name[64];
+
+        memset(hash, (int) i, sizeof hash);
+        snprintf(name, sizeof name, "Some.Shared.Movie.Name.Part.%03u.avi", i);
+
+        p = put(p, hash, sizeof hash);
+        p = put_uint32(p, 0xfbfbfbfb);
+        p = put_uint16(p, 0xfbfb);
+        p = put_uint32(p, 5);
+        p = put_tag_str(p, TN_FILENAME, name, newtags);
+        p = put_tag_uint32(p, TN_FILESIZE, 700 * 1024 * 1024 + i, newtags);
+        p = put_tag_str(p, TN_FILETYPE, "Video", newtags);
+        p = put_tag_uint32(p, TN_MEDIA_LENGTH, 5400, newtags);
+        p = put_tag_str(p, TN_MEDIA_CODEC, "xvid", newtags);
+    }
+
+    return p - buf;
+}
+
+static unsigned char *put_search_str(unsigned char *p, const char *str)
+{
+    uint16_t len = strlen(str);
+    return put(put_uint16(put_uint8(p, SO_STRING_TERM), len), str, len);
+}
+
+static size_t make_search(unsigned char *buf)
+{
+    static const unsigned char ext_tail[] = {0x01, 0x00, 0x04};
+    unsigned char *p = buf;
+
+    // (movie AND part) AND ext=avi AND size>=1M
+    p = put_uint16(p, SO_AND);
+    p = put_uint16(p, SO_AND);
+    p = put_search_str(p, "movie");
+    p = put_search_str(p, "part");
+    p = put_uint16(p, SO_AND);
+    p = put_uint16(put_uint8(p, SO_STRING_CONSTR), 3);
+    p = put(p, "avi", 3);
+    p = put(p, ext_tail, sizeof ext_tail);
+    p = put_uint32(put_uint32(put_uint8(p, SO_UINT32), 1024 * 1024), SC_MINSIZE);
+
+    return p - buf;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_offer(const char *title, const unsigned char *buf, size_t len, int newtags, long iterations)
+{
+    double start = now_ns(), elapsed;
+    long i;
+
+    for (i = 0; i < iterations; ++i) {
+        struct packet_buffer pb;
+        struct pub_file *files;
+        size_t count;
+
+        PB_INIT(&pb, buf, len);
+        if (!read_offer_files(&pb, newtags, &files, &count)) {
+            fprintf(stderr, "%s: parse failed\n", title);
+            exit(EXIT_FAILURE);
+        }
+        free(files);
+    }
+
+    elapsed = now_ns() - start;
+    printf("%-18s %6zu bytes  %9.0f ns/packet  %7.1f MB/s\n", title, len,
+            elapsed / iterations, len * iterations / elapsed * 1e3);
+}
+
+static void bench_search(const unsigned char *buf, size_t len, long iterations)
+{
+    double start = now_ns(), elapsed;
+    long i;
+
+    for (i = 0; i < iterations; ++i) {
+        struct packet_buffer pb;
+        struct search_node nodes[MAX_SEARCH_NODES];
+
+        PB_INIT(&pb, buf, len);
+        if (!read_search_tree(&pb, nodes, MAX_SEARCH_NODES)) {
+            fprintf(stderr, "search: parse failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    elapsed = now_ns() - start;
+    printf("%-18s %6zu bytes  %9.0f ns/packet  %7.1f MB/s\n", "search", len,
+            elapsed / iterations, len * iterations / elapsed * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned char buf[BENCH_BUF_SIZE];
+    long iterations = argc > 1 ? atol(argv[1]) : 10000;
+    size_t len;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    len = make_offer(buf, 0);
+    bench_offer("offer (old tags)", buf, len, 0, iterations);
+
+    len = make_offer(buf, 1);
+    bench_offer("offer (new tags)", buf, len, 1, iterations);
+
+    len = make_search(buf);
+    bench_search(buf, len, iterations * 100);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+/*
+@file fuzz_parse.c libFuzzer target for packet parsers
+
+First input byte selects parser, the rest is packet payload as it is
+passed to parser by server_read(), i.e. without header and opcode.
+Successfully parsed offers are written back as search result entries
+and parsed search trees are serialized into cache keys, so walkers of
+parser output are covered as well.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "packet.h"
+#include "search_cache.h"
+
+/* packet.c refers to server instance */
+struct server_instance g_srv;
+
+enum fuzz_selector {
+    /* OP_OFFERFILES from client without CLI_CAP_NEWTAGS */
+    FUZZ_OFFER = 0x00,
+    /* OP_OFFERFILES from client with CLI_CAP_NEWTAGS */
+    FUZZ_OFFER_NEWTAGS = 0x01,
+    /* OP_SEARCHREQUEST */
+    FUZZ_SEARCH = 0x02,
+    /* payload is PROTO_PACKED */
+    FUZZ_PACKED = 0x04
+};
+
+static void fuzz_offer(struct packet_buffer *pb, int newtags)
+{
+    struct pub_file *files;
+    struct evbuffer *buf;
+    size_t count, i;
+
+    if (!read_offer_files(pb, newtags, &files, &count))
+        return;
+
+    buf = evbuffer_new();
+
+    for (i = 0; i < count; ++i) {
+        struct search_file sfile;
+        const struct pub_file *f = &files[i];
+
+        memset(&sfile, 0, sizeof sfile);
+        sfile.hash = f->hash;
+        sfile.name_len = f->name_len;
+        sfile.name = f->name;
+        sfile.size = f->size;
+        sfile.type = f->type;
+        sfile.rating = f->rating;
+        sfile.media_length = f->media_length;
+        sfile.media_bitrate = f->media_bitrate;
+        sfile.media_codec_len = f->media_codec_len > MAX_FILEEXT_LEN ? MAX_FILEEXT_LEN : f->media_codec_len;
+        sfile.media_codec = f->media_codec;
+
+        if (!write_search_file(buf, &sfile, newtags ? SFF_NEWTAGS : 0))
+            abort();
+    }
+
+    evbuffer_free(buf);
+    free(files);
+}
+
+static void fuzz_search(struct packet_buffer *pb)
+{
+    struct search_node nodes[MAX_SEARCH_NODES];
+    unsigned char key[MAX_SEARCH_KEY_LEN];
+
+    if (read_search_tree(pb, nodes, MAX_SEARCH_NODES))
+        search_cache_make_key(&nodes[0], 0, key);
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void) argc;
+    (void) argv;
+
+    // cache keys are made only for enabled cache
+    search_cache_init(1, 0);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct packet_buffer pb;
+    uint8_t selector;
+
+    if (size < 1)
+        return 0;
+
+    selector = data[0];
+    data++;
+    size--;
+
+    if (selector & FUZZ_PACKED) {
+        data = packet_inflate(data, size, &size);
+        if (!data)
+            return 0;
+    }
+
+    PB_INIT(&pb, data, size);
+
+    if (selector & FUZZ_SEARCH)
+        fuzz_search(&pb);
+    else
+        fuzz_offer(&pb, selector & FUZZ_OFFER_NEWTAGS);
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+@file test_sources.c Order of sources returned for SRC_SELECT_COMPLETE
+
+Shares one file from a lowid, a highid right above MAX_LOWID and a
+highid with top bit set (x.x.x.128 and above in network order), and
+checks that complete selection returns both highids before the lowid.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "client.h"
+#include "db.h"
+#include "ed2k_proto.h"
+
+/* database backends refer to server instance */
+struct server_instance g_srv;
+
+#define CHECK(x) \
+    if (!(x)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+        return EXIT_FAILURE; \
+    }
+
+static int share(struct pub_file *file, uint32_t id, uint16_t port)
+{
+    struct client clnt;
+
+    memset(&clnt, 0, sizeof clnt);
+    clnt.id = id;
+    clnt.port = port;
+    clnt.lowid = id < MAX_LOWID;
+
+    return db_share_files(file, 1, &clnt);
+}
+
+int main(void)
+{
+    // 10.0.0.1 and 128.1.1.128 in network order, the latter has top bit set
+    static const uint32_t lowid = 5, highid_low = 0x0100000a, highid_top = 0x80010180;
+    struct file_source sources[4];
+    struct pub_file file;
+    uint8_t count = sizeof sources / sizeof sources[0];
+
+    memset(&file, 0, sizeof file);
+    memset(file.hash, 0xab, sizeof file.hash);
+    strcpy(file.name, "test.avi");
+    file.name_len = strlen(file.name);
+    file.size = 1024;
+
+    CHECK(db_create());
+    CHECK(db_open());
+
+    // lowid shared first, so insertion order alone does not give expected order
+    CHECK(share(&file, lowid, 4661));
+    CHECK(share(&file, highid_top, 4662));
+    CHECK(share(&file, highid_low, 4663));
+
+    CHECK(db_get_sources(file.hash, sources, &count, SRC_SELECT_COMPLETE));
+    CHECK(3 == count);
+    CHECK(sources[0].ip >= MAX_LOWID);
+    CHECK(sources[1].ip >= MAX_LOWID);
+    CHECK(lowid == sources[2].ip);
+    CHECK(4661 == sources[2].port);
+
+    db_close();
+    db_destroy();
+
+    return EXIT_SUCCESS;
+}